@@ -0,0 +1,431 @@
+#define _GNU_SOURCE
+// Bibliotecas necesarias
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+// Valores por defecto
+#define DEFAULT_DIR "corpus"
+#define DEFAULT_BINARIO "./minigrep"
+#define DEFAULT_PATRON "error"
+#define DEFAULT_TAMANOS "16,1024,65536,1048576"
+#define DEFAULT_OPCIONES ",-c,-v,-m read,-m read -c"
+#define DEFAULT_MB 64
+#define DEFAULT_REPETICIONES 3
+
+#define TAM_ESCRITURA (1 << 20)  // Buffer del generador
+#define MAX_ARGUMENTOS 64        // Argumentos de cada ejecución de minigrep
+
+// Tipos de corpus que se generan
+struct Corpus {
+    const char *nombre;
+    int min_linea;      // Longitud mínima de línea (sin el '\n')
+    int max_linea;      // Longitud máxima de línea
+    int porcentaje;     // Porcentaje de líneas que contienen el patrón
+    int salto_final;    // Termina en '\n'
+};
+
+static const struct Corpus corpus[] = {
+    {"cortas", 20, 80, 1, 1},
+    {"largas", 16384, 262144, 10, 1},
+    {"coincidencias", 20, 80, 90, 1},
+    {"ninguna", 20, 80, 0, 1},
+    {"sin_salto", 20, 80, 1, 0}, // La última línea sin '\n' (camino de la cadena final)
+};
+#define NCORPUS (int)(sizeof(corpus) / sizeof(corpus[0]))
+
+// Opciones de la línea de comandos
+struct Opciones {
+    const char *dir;        // Directorio del corpus
+    const char *binario;    // minigrep que se mide
+    const char *patron;
+    char *tamanos;          // Lista de BUFSIZE separados por comas
+    char *opciones;         // Lista de conjuntos de opciones separados por comas
+    int generar;            // Generar el corpus antes de medir
+    long mb;                // Tamaño de cada fichero del corpus en MB
+    int repeticiones;       // Se muestra la mejor de las repeticiones
+};
+
+// Resultado de una ejecución
+struct Medida {
+    double segundos;
+    double usuario;
+    double sistema;
+    long rss_kb;            // Pico de memoria residente
+    long long lecturas;     // Llamadas read() y similares
+    long long escrituras;   // Llamadas write() y similares
+    int estado;
+};
+
+static uint64_t semilla = 0x9e3779b97f4a7c15ULL;
+
+// Función para imprimir el uso del programa
+void printUso(int exit_code) {
+    fprintf(stderr, "Uso: ./minibench [-g] [-d DIR] [-t MB] [-b MINIGREP] [-p REGEX] [-s TAMAÑOS] [-o OPCIONES] [-n REPETICIONES] [-h]\n"
+                    "\t-g Genera el corpus en DIR antes de medir.\n"
+                    "\t-d DIR Directorio del corpus (por defecto, %s).\n"
+                    "\t-t MB Tamaño de cada fichero generado (por defecto, %d).\n"
+                    "\t-b MINIGREP Programa que se mide (por defecto, %s).\n"
+                    "\t-p REGEX Expresión que se busca; el corpus se genera para '%s' (por defecto, %s).\n"
+                    "\t-s TAMAÑOS Valores de BUFSIZE separados por comas (por defecto, %s).\n"
+                    "\t-o OPCIONES Conjuntos de opciones separados por comas (por defecto, \"%s\").\n"
+                    "\t-n REPETICIONES Se muestra la más rápida (por defecto, %d; 0 solo genera).\n"
+                    "La salida es una línea JSON por medida.\n\n",
+            DEFAULT_DIR, DEFAULT_MB, DEFAULT_BINARIO, DEFAULT_PATRON, DEFAULT_PATRON, DEFAULT_TAMANOS,
+            DEFAULT_OPCIONES, DEFAULT_REPETICIONES);
+    exit(exit_code);
+}
+
+// Función para leer un valor de BUFSIZE de la lista de -s
+long leerTamano(const char *texto) {
+    char *fin;
+    errno = 0;
+    long tamano = strtol(texto, &fin, 10);
+    if (fin == texto || *fin != '\0' || errno != 0 || tamano < 1) {
+        fprintf(stderr, "ERROR: '%s' no es un BUFSIZE válido\n", texto);
+        exit(EXIT_FAILURE);
+    }
+    return tamano;
+}
+
+// Función para comprobar todos los valores de la lista de -s antes de medir nada
+void comprobarTamanos(const char *lista) {
+    char *copia = strdup(lista);
+    char *resto = copia, *tamano;
+    while ((tamano = strsep(&resto, ",")) != NULL) {
+        if (*tamano != '\0') {
+            leerTamano(tamano);
+        }
+    }
+    free(copia);
+}
+
+// Función para procesar los argumentos de la línea de comandos
+void procesarArgumentos(int argc, char *argv[], struct Opciones *op) {
+    int opt;
+    while ((opt = getopt(argc, argv, "gd:t:b:p:s:o:n:h")) != -1) {
+        switch (opt) {
+        case 'g':
+            op->generar = 1;
+            break;
+        case 'd':
+            op->dir = optarg;
+            break;
+        case 't':
+            op->mb = atol(optarg);
+            if (op->mb < 1) {
+                fprintf(stderr, "ERROR: MB debe ser mayor que 0\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'b':
+            op->binario = optarg;
+            break;
+        case 'p':
+            op->patron = optarg;
+            break;
+        case 's':
+            comprobarTamanos(optarg);
+            op->tamanos = optarg;
+            break;
+        case 'o':
+            op->opciones = optarg;
+            break;
+        case 'n':
+            op->repeticiones = atoi(optarg);
+            if (op->repeticiones < 0) {
+                fprintf(stderr, "ERROR: REPETICIONES no puede ser negativo\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'h':
+            printUso(EXIT_SUCCESS);
+            break;
+        default:
+            printUso(EXIT_FAILURE);
+        }
+    }
+}
+
+// Función para generar números pseudoaleatorios reproducibles (xorshift64*)
+uint64_t aleatorio(void) {
+    semilla ^= semilla >> 12;
+    semilla ^= semilla << 25;
+    semilla ^= semilla >> 27;
+    return semilla * 0x2545f4914f6cdd1dULL;
+}
+
+// Función para escribir un buffer completo
+void escribirTodo(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "ERROR: write()\n");
+            exit(EXIT_FAILURE);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+// Función para generar un fichero del corpus. El texto de relleno no lleva ni 'o' ni 'r',
+// así que el patrón por defecto solo aparece donde se inserta
+void generarCorpus(const char *dir, const struct Corpus *c, long mb) {
+    static const char letras[] = "abcdefghijklmnpqstuvwxyz      0123456789ABCDEFGHIJKLMNPQSTUVWXYZ";
+    char ruta[PATH_MAX];
+    snprintf(ruta, sizeof(ruta), "%s/%s.txt", dir, c->nombre);
+    int fd = open(ruta, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "ERROR: no se puede crear '%s'\n", ruta);
+        exit(EXIT_FAILURE);
+    }
+
+    char *buf = malloc(TAM_ESCRITURA);
+    if (buf == NULL) {
+        fprintf(stderr, "ERROR: malloc()\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t total = (size_t)mb << 20;
+    size_t escrito = 0, len = 0;
+    while (escrito + len < total) {
+        size_t linea = c->min_linea + aleatorio() % (c->max_linea - c->min_linea + 1);
+        if (linea > total - escrito - len) {
+            linea = total - escrito - len;
+        }
+        size_t con_patron = (int)(aleatorio() % 100) < c->porcentaje ? aleatorio() % (linea + 1) : (size_t)-1;
+        for (size_t i = 0; i <= linea; i++) {
+            if (len == TAM_ESCRITURA) {
+                escribirTodo(fd, buf, len);
+                escrito += len;
+                len = 0;
+            }
+            if (i == con_patron) {
+                // El patrón se inserta entero aunque alargue un poco la línea
+                for (const char *p = DEFAULT_PATRON; *p != '\0'; p++) {
+                    buf[len++] = *p;
+                    if (len == TAM_ESCRITURA) {
+                        escribirTodo(fd, buf, len);
+                        escrito += len;
+                        len = 0;
+                    }
+                }
+            }
+            buf[len++] = i < linea ? letras[aleatorio() % (sizeof(letras) - 1)] : '\n';
+        }
+    }
+    // Quitar el último '\n' si el corpus no debe tenerlo
+    if (!c->salto_final && len > 0 && buf[len - 1] == '\n') {
+        len--;
+    }
+    escribirTodo(fd, buf, len);
+    free(buf);
+    close(fd);
+}
+
+// Función para contar las líneas de un fichero, incluida una última sin '\n'
+long long contarLineas(const char *ruta, off_t *bytes) {
+    int fd = open(ruta, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "ERROR: no se puede abrir '%s'\n", ruta);
+        exit(EXIT_FAILURE);
+    }
+    *bytes = st.st_size;
+    long long lineas = 0;
+    if (st.st_size > 0) {
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "ERROR: mmap()\n");
+            exit(EXIT_FAILURE);
+        }
+        const char *p = map, *end = map + st.st_size, *salto;
+        while ((salto = memchr(p, '\n', end - p)) != NULL) {
+            lineas++;
+            p = salto + 1;
+        }
+        lineas += p < end;
+        munmap(map, st.st_size);
+    }
+    close(fd);
+    return lineas;
+}
+
+// Función para leer de /proc/PID/io las llamadas de lectura y escritura de un proceso
+void leerLlamadas(pid_t pid, struct Medida *m) {
+    char ruta[64], linea[128];
+    snprintf(ruta, sizeof(ruta), "/proc/%d/io", (int)pid);
+    m->lecturas = m->escrituras = -1;
+    FILE *f = fopen(ruta, "r");
+    if (f == NULL) {
+        return;
+    }
+    while (fgets(linea, sizeof(linea), f) != NULL) {
+        sscanf(linea, "syscr: %lld", &m->lecturas);
+        sscanf(linea, "syscw: %lld", &m->escrituras);
+    }
+    fclose(f);
+}
+
+// Función para ejecutar minigrep una vez con la entrada y la salida redirigidas
+void ejecutar(char *const args[], const char *entrada, struct Medida *m) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pid_t pid = fork();
+    if (pid == -1) {
+        fprintf(stderr, "ERROR: fork()\n");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        int in = open(entrada, O_RDONLY);
+        int out = open("/dev/null", O_WRONLY);
+        if (in == -1 || out == -1) {
+            _exit(127);
+        }
+        dup2(in, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        execv(args[0], args);
+        _exit(127);
+    }
+
+    // Esperar sin recoger al hijo para poder leer sus contadores de /proc
+    siginfo_t info;
+    while (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) == -1 && errno == EINTR) {
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    leerLlamadas(pid, m);
+
+    int estado;
+    struct rusage uso;
+    while (wait4(pid, &estado, 0, &uso) == -1 && errno == EINTR) {
+    }
+    m->segundos = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    m->usuario = uso.ru_utime.tv_sec + uso.ru_utime.tv_usec / 1e6;
+    m->sistema = uso.ru_stime.tv_sec + uso.ru_stime.tv_usec / 1e6;
+    m->rss_kb = uso.ru_maxrss;
+    m->estado = WIFEXITED(estado) ? WEXITSTATUS(estado) : 128 + WTERMSIG(estado);
+}
+
+// Función para escribir una cadena como valor JSON
+void imprimirCadena(const char *s) {
+    putchar('"');
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            putchar('\\');
+        }
+        putchar(*s);
+    }
+    putchar('"');
+}
+
+// Función para medir un fichero del corpus con un BUFSIZE y un conjunto de opciones
+void medir(struct Opciones *op, const char *nombre, const char *entrada, off_t bytes, long long lineas,
+           long tamano, const char *opciones) {
+    // Argumentos: minigrep -r PATRON -s BUFSIZE OPCIONES...
+    char copia[1024], texto_tamano[32];
+    snprintf(copia, sizeof(copia), "%s", opciones);
+    snprintf(texto_tamano, sizeof(texto_tamano), "%ld", tamano);
+    char *args[MAX_ARGUMENTOS];
+    int n = 0;
+    args[n++] = (char *)op->binario;
+    args[n++] = "-r";
+    args[n++] = (char *)op->patron;
+    args[n++] = "-s";
+    args[n++] = texto_tamano;
+    char *guardado;
+    for (char *a = strtok_r(copia, " ", &guardado); a != NULL && n < MAX_ARGUMENTOS - 1; a = strtok_r(NULL, " ", &guardado)) {
+        args[n++] = a;
+    }
+    args[n] = NULL;
+
+    struct Medida mejor;
+    memset(&mejor, 0, sizeof(mejor));
+    for (int i = 0; i < op->repeticiones; i++) {
+        struct Medida m;
+        ejecutar(args, entrada, &m);
+        if (i == 0 || m.segundos < mejor.segundos) {
+            mejor = m;
+        }
+    }
+
+    printf("{\"corpus\":");
+    imprimirCadena(nombre);
+    printf(",\"bufsize\":%ld,\"opciones\":", tamano);
+    imprimirCadena(opciones);
+    printf(",\"bytes\":%lld,\"lineas\":%lld,\"segundos\":%.6f,\"usuario\":%.6f,\"sistema\":%.6f"
+           ",\"gb_s\":%.4f,\"lineas_s\":%.0f,\"lecturas\":%lld,\"escrituras\":%lld,\"rss_kb\":%ld,\"estado\":%d}\n",
+           (long long)bytes, lineas, mejor.segundos, mejor.usuario, mejor.sistema,
+           mejor.segundos > 0 ? bytes / mejor.segundos / 1e9 : 0.0,
+           mejor.segundos > 0 ? lineas / mejor.segundos : 0.0,
+           mejor.lecturas, mejor.escrituras, mejor.rss_kb, mejor.estado);
+    fflush(stdout);
+}
+
+// Función principal del programa
+int main(int argc, char *argv[]) {
+    struct Opciones op;
+    memset(&op, 0, sizeof(op));
+    op.dir = DEFAULT_DIR;
+    op.binario = DEFAULT_BINARIO;
+    op.patron = DEFAULT_PATRON;
+    op.tamanos = strdup(DEFAULT_TAMANOS);
+    op.opciones = strdup(DEFAULT_OPCIONES);
+    op.mb = DEFAULT_MB;
+    op.repeticiones = DEFAULT_REPETICIONES;
+
+    procesarArgumentos(argc, argv, &op);
+    if (access(op.binario, X_OK) != 0 && op.repeticiones > 0) {
+        fprintf(stderr, "ERROR: no se puede ejecutar '%s'\n", op.binario);
+        exit(EXIT_FAILURE);
+    }
+
+    if (op.generar) {
+        if (mkdir(op.dir, 0755) == -1 && errno != EEXIST) {
+            fprintf(stderr, "ERROR: no se puede crear '%s'\n", op.dir);
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < NCORPUS; i++) {
+            generarCorpus(op.dir, &corpus[i], op.mb);
+        }
+    }
+    if (op.repeticiones == 0) {
+        return EXIT_SUCCESS;
+    }
+
+    // Matriz corpus x BUFSIZE x opciones. Las listas se separan por comas y un
+    // conjunto de opciones vacío es válido
+    for (int i = 0; i < NCORPUS; i++) {
+        char entrada[PATH_MAX];
+        snprintf(entrada, sizeof(entrada), "%s/%s.txt", op.dir, corpus[i].nombre);
+        off_t bytes;
+        long long lineas = contarLineas(entrada, &bytes);
+        char *tamanos = strdup(op.tamanos);
+        char *resto_t = tamanos, *tamano;
+        while ((tamano = strsep(&resto_t, ",")) != NULL) {
+            if (*tamano == '\0') {
+                continue;
+            }
+            char *opciones = strdup(op.opciones);
+            char *resto_o = opciones, *conjunto;
+            while ((conjunto = strsep(&resto_o, ",")) != NULL) {
+                medir(&op, corpus[i].nombre, entrada, bytes, lineas, leerTamano(tamano), conjunto);
+            }
+            free(opciones);
+        }
+        free(tamanos);
+    }
+    return EXIT_SUCCESS;
+}
@@ -1,4 +1,4 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 // Bibliotecas necesarias
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,30 +6,308 @@
 #include <regex.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <time.h>
+#ifdef MINIGREP_ZLIB
+#include <zlib.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MINIGREP_X86
+#endif
 
 // Definiciones de constantes
 #define DEFAULT_BUFSIZE 1024
 #define MIN_BUFSIZE 1
 #define MAX_BUFSIZE 1048576
-#define MAX_LINE_SIZE 4096
+#define MIN_LECTURA 65536   // Capacidad mínima del buffer de lectura en modo read()
+#define OPCION_STATS 256    // --stats (fuera del rango de las opciones de una letra)
+
+// Modos de lectura de la entrada
+#define MODO_AUTO 0  // mmap si la entrada es un fichero regular, read() en otro caso
+#define MODO_MMAP 1  // Forzar la proyección en memoria
+#define MODO_READ 2  // Forzar el bucle de lectura con read()
+
+// Búsqueda en paralelo
+#define MAX_HILOS 256          // Número máximo de hilos de búsqueda
+#define TAM_TROZO (1 << 20)    // Tamaño aproximado de cada trozo de entrada repartido a los hilos
+
+// Búsqueda en ficheros y directorios
+#define TAM_DENTS 32768        // Buffer de getdents64() de cada hilo
+#define MIN_PROYECCION 65536   // Los ficheros más pequeños se leen con read() en vez de proyectarse
+
+// Entrada comprimida
+#define TAM_GZIP 131072        // Lecturas de la entrada comprimida con gzip
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// Acumulador de salida: trozos de línea que se escriben juntos con writev()
+// directamente desde el buffer de entrada, sin copiarlos
+struct Salida {
+    int fd;                // Descriptor de destino (-1 si solo se acumula y se escribe después)
+    struct iovec *iov;     // Trozos pendientes de escribir
+    int niov;
+    int cap;
+    size_t bytes;          // Bytes pendientes
+    size_t limite;         // Se escribe al llegar a este tamaño (BUFSIZE)
+    const char *prefijo;   // Se pone delante de cada línea ("fichero:"), NULL si no hay
+    const char *prefijo_contexto; // Prefijo de las líneas de contexto ("fichero-")
+    size_t prefijo_len;
+};
+
+// Línea anterior a la posición actual que todavía no se ha escrito
+struct LineaPrevia {
+    long long posicion; // Posición en la entrada
+    size_t len;         // Con su '\n'
+};
+
+// Líneas de contexto alrededor de las aceptadas (-A/-B/-C). Las anteriores se guardan como
+// posiciones dentro del buffer de entrada, que las conserva mientras hagan falta
+struct Contexto {
+    int antes;                  // -B
+    int despues;                // -A
+    int pendientes;             // Líneas que faltan por escribir tras la última aceptada
+    long long posicion;         // Posición en la entrada del principio del bloque actual
+    long long fin_escrito;      // Posición donde acaba lo último escrito
+    int escrito;                // Ya se ha escrito algo (para los separadores "--")
+    struct LineaPrevia *anillo; // Últimas líneas sin escribir, hasta antes
+    int primera;                // Índice en el anillo de la más antigua
+    int nprevias;
+};
+
+// Etapas medidas con --stats
+#define ETAPA_LECTURA 0     // read()
+#define ETAPA_PROYECCION 1  // mmap() y consejos al núcleo
+#define ETAPA_COPIA 2       // Arrastre de líneas incompletas al principio del buffer
+#define ETAPA_BUSQUEDA 3    // Comprobar líneas (sin contar las escrituras que provoca)
+#define ETAPA_ESCRITURA 4   // writev()
+#define ETAPA_DESCOMPRESION 5 // inflate()
+#define NUM_ETAPAS 6
+#define NUM_CUBETAS 33      // Histograma de longitudes de línea por potencias de 2
+
+// Contadores de --stats. Solo se tocan si están activas, con sumas atómicas porque
+// los actualizan todos los hilos
+struct Estadisticas {
+    int activas;
+    uint64_t inicio;              // Reloj al empezar, en ns
+    uint64_t ns[NUM_ETAPAS];      // Tiempo de cada etapa sumado entre hilos
+    uint64_t bytes;               // Bytes de entrada comprobados
+    uint64_t lineas;
+    uint64_t aceptadas;
+    uint64_t lecturas;
+    uint64_t bytes_leidos;
+    uint64_t escrituras;
+    uint64_t bytes_escritos;
+    uint64_t arrastres;           // Veces que se ha movido una línea incompleta
+    uint64_t bytes_arrastrados;
+    uint64_t cubetas[NUM_CUBETAS]; // Cubeta i: longitudes en [2^(i-1), 2^i), la 0 para líneas vacías
+                                   // y la última para todas las de 2^31 o más
+};
+
+struct Estadisticas estadisticas;
+__thread uint64_t ns_escritura_hilo; // Tiempo de escritura del hilo, para descontarlo de la búsqueda
+
+#ifdef MINIGREP_ZLIB
+// Entrada comprimida con gzip: la estándar, o un fichero del recorrido ya leído o proyectado.
+// Lo que sale de inflate() va directamente al buffer de quien lee, sin pasar por un pipe ni
+// por otro buffer
+struct Entrada {
+    unsigned char cabecera[2]; // Bytes leídos para detectar la compresión
+    size_t ncabecera;
+    size_t usados;             // Bytes de la cabecera ya devueltos
+    int gzip;
+    z_stream z;
+    unsigned char *comprimido; // Buffer de lectura de la entrada comprimida
+    int fin_lectura;           // read() ha devuelto 0
+    int miembro_completo;      // El último miembro ha terminado y no ha empezado otro
+    int terminada;
+    const char *error;         // Motivo si está truncada o dañada
+};
+
+struct Entrada entrada;
+#endif
+
+// Filtro previo de líneas por literal
+#define MAX_LITERAL 256        // Longitud máxima del literal obligatorio extraído de la expresión
+
+// Motores para comprobar la expresión regular
+#define MOTOR_AUTO 0   // DFA si la expresión lo permite, regexec() en otro caso
+#define MOTOR_DFA 1    // Forzar el DFA perezoso
+#define MOTOR_POSIX 2  // Forzar regexec()
+
+// Límites del DFA perezoso
+#define NFA_MAX_ESTADOS 16384   // Tamaño máximo del NFA (las repeticiones {m,n} se expanden)
+#define DFA_MEMORIA (1 << 21)   // Bytes de la caché de estados; al llenarse se vacía
+#define DFA_DESCONOCIDO -1      // Transición todavía sin calcular
+#define DFA_SALTO -2            // Transición con '\n': fin de línea
+// Las transiciones guardan la posición de la fila del estado destino (estado * nclases) para
+// ahorrar la multiplicación en el bucle; las de estados de aceptación se guardan como -(estado + 3)
+
+// Tipos de nodo del árbol sintáctico de la expresión
+#define NODO_VACIO 0
+#define NODO_CLASE 1    // Un byte de un conjunto
+#define NODO_CONCAT 2
+#define NODO_ALT 3
+#define NODO_REPETIR 4  // {min,max}, con max -1 si no hay límite
+#define NODO_INICIO 5   // ^
+#define NODO_FIN 6      // $
+
+struct Nodo {
+    int tipo;
+    int a, b;      // Hijos
+    int min, max;
+    int clase;     // Conjunto de bytes de NODO_CLASE
+};
+
+// Estado del analizador de la expresión
+struct Parser {
+    const char *p;
+    struct Nodo *nodos;
+    int nnodos, cap;
+    uint8_t (*conj)[32];   // Conjuntos de bytes como mapas de 256 bits
+    int nconj, capconj;
+    int error;             // La expresión usa algo que el DFA no soporta
+};
+
+// Tipos de estado del NFA
+#define NFA_CLASE 0    // Consume un byte del conjunto clase
+#define NFA_SPLIT 1    // Dos transiciones vacías
+#define NFA_INICIO 2   // Solo se pasa a principio de línea
+#define NFA_FIN 3      // Solo se pasa a final de línea
+#define NFA_ACEPTA 4
+
+struct NfaEstado {
+    int tipo;
+    int sig, sig2;
+    int clase;
+};
+
+// Estado del DFA: conjunto de estados del NFA
+struct DfaEstado {
+    int conjunto;   // Posición de la lista de estados del NFA en conjuntos
+    int n;
+    int acepta;     // Contiene el estado de aceptación
+    int acepta_eol; // Acepta si la línea termina aquí
+};
+
+// DFA construido de forma perezosa a partir del NFA, con una caché de estados de tamaño fijo
+struct Dfa {
+    struct NfaEstado *nfa;
+    int nnfa;
+    int inicio_nfa;
+    uint8_t (*conjuntos_bytes)[32];
+    uint8_t clase[256];      // Clase de equivalencia de cada byte
+    int nclases;
+    int *trans;              // max_estados x nclases transiciones
+    struct DfaEstado *estados;
+    int nestados, max_estados;
+    int *conjuntos;          // Listas de estados del NFA de todos los estados del DFA
+    int nconjuntos, capconjuntos;
+    int *hash;               // Índice de los estados por su conjunto
+    int hash_cap;
+    int inicial;             // Estado de principio de línea (-1 si hay que calcularlo)
+    int vacia;               // La línea vacía es reconocida
+    int todas;               // Toda línea es reconocida
+    int vaciados;            // Veces que se ha vaciado la caché
+    int *pila, *marca, *tmp; // Auxiliares para los cierres
+    int generacion;
+};
+
+// Autómata de Aho-Corasick para buscar a la vez muchos patrones literales. Las transiciones
+// están completas y en una sola tabla contigua por clases de bytes, como las del DFA
+struct AhoCorasick {
+    uint8_t clase[256];  // Clase de cada byte (0 para los que no salen en ningún literal)
+    int nclases;
+    int *trans;          // nestados x nclases; guardan la fila del destino y ~fila si termina un literal
+    int nestados;
+};
+
+// Patrones de búsqueda: los literales van al autómata de Aho-Corasick y las expresiones
+// regulares al DFA o a regexec(). Para una sola expresión se usa el literal obligatorio
+struct Buscador {
+    regex_t *regex;            // Expresiones regulares compiladas con regcomp()
+    char **patrones;           // Texto de las expresiones, para compilar copias por hilo
+    int nregex;
+    struct Dfa *dfa;           // DFA de todas las expresiones (NULL si se usa regexec())
+    char literal[MAX_LITERAL];
+    size_t literal_len;        // 0 si la expresión no obliga a ningún literal
+    int exacto;                // La expresión es exactamente el literal y no hace falta regexec()
+    struct AhoCorasick *ac;    // Patrones literales (NULL si no hay), compartido entre hilos
+    int ac_valido;             // Hay guardada una búsqueda del autómata para el buffer actual
+    const char *ac_ls;         // Siguiente línea con un literal (NULL si no hay más)
+    const char *ac_le;
+};
+
+// Opciones de la línea de comandos
+struct Opciones {
+    char **patrones;    // Patrones de -r, -e y -f
+    int npatrones;
+    int invertir;       // -v
+    int regex_flag;     // 0 sin expresión, 1 normal, -1 invertida
+    int count_flag;     // Mostrar solo el número de líneas aceptadas
+    int bufsize;        // Tamaño de los buffers de lectura y escritura
+    int modo;           // Forma de leer la entrada
+    int hilos;          // Número de hilos de búsqueda
+    int motor;          // Motor de expresiones regulares
+    long long maxlinea; // Longitud máxima de una línea (0 sin límite)
+    char **rutas;       // Ficheros y directorios en los que buscar (ninguno para la entrada estándar)
+    int nrutas;
+    int recursivo;      // -R: buscar dentro de los directorios
+    int nombres;        // Poner el nombre del fichero delante de cada línea
+    int antes;          // Líneas de contexto antes de cada aceptada (-1 sin contexto)
+    int despues;        // Líneas de contexto después de cada aceptada (-1 sin contexto)
+    int descomprimir;   // -z: la entrada tiene que ser gzip
+    struct Buscador buscador; // Filtro por literal delante de regexec()
+};
 
 // Función para imprimir el uso del programa
 void printUsage(int exit_code) {
-    fprintf(stderr, "Uso: ./minigrep -r REGEX [-s BUFSIZE] [-v] [-c] [-h]\n"
+    fprintf(stderr, "Uso: ./minigrep {-r REGEX | -e PATRON | -f FICHERO}... [-s BUFSIZE] [-v] [-c] [-m MODO] [-j N] [-x MOTOR] [-L MAXLINEA] [-A NUM] [-B NUM] [-C NUM] [-R] [-H] [-z] [--stats] [-h] [RUTA...]\n"
                     "\t-r REGEX Expresión regular.\n"
+                    "\t-e PATRON Patrón adicional; se aceptan las líneas que reconozca alguno.\n"
+                    "\t-f FICHERO Patrones adicionales, uno por línea.\n"
                     "\t-s BUFSIZE Tamaño de los buffers de lectura y escritura en bytes (por defecto, 1024).\n"
                     "\t-v Acepta las líneas que NO sean reconocidas por la expresión regular (por defecto, falso).\n"
-                    "\t-c Muestra el número total de líneas aceptadas (por defecto, falso).\n\n");
+                    "\t-c Muestra el número total de líneas aceptadas (por defecto, falso).\n"
+                    "\t-m MODO Lectura de la entrada: auto, mmap o read (por defecto, auto).\n"
+                    "\t-j N Número de hilos de búsqueda, entre 1 y 256 (por defecto, 1).\n"
+                    "\t-x MOTOR Motor de expresiones regulares: auto, dfa o posix (por defecto, auto).\n"
+                    "\t-L MAXLINEA Longitud máxima de línea en bytes al leer con read() o descomprimir gzip (por defecto, sin límite).\n"
+                    "\t-A NUM Muestra NUM líneas de contexto después de cada línea aceptada.\n"
+                    "\t-B NUM Muestra NUM líneas de contexto antes de cada línea aceptada.\n"
+                    "\t-C NUM Muestra NUM líneas de contexto antes y después (-A y -B tienen prioridad).\n"
+                    "\t-R Busca en los ficheros de los directorios, recursivamente y sin seguir enlaces simbólicos.\n"
+                    "\t-H Pone el nombre del fichero delante de cada línea (por defecto, con varios ficheros o -R).\n"
+                    "\t-z Exige que la entrada esté comprimida con gzip (por defecto, se detecta por su cabecera).\n"
+                    "\t--stats Al terminar, muestra por la salida de error dónde se ha ido el tiempo.\n"
+                    "\tRUTA Ficheros o directorios en los que buscar (por defecto, la entrada estándar; con -R, '.').\n\n");
     exit(exit_code); // Sale con el código de salida proporcionado
 }
 
 // Función para verificar si los argumentos están en un rango válido
-void verificarArgumentos(int bufsize, int regex_flag) {
+void verificarArgumentos(int bufsize, int regex_flag, int hilos) {
     // Si el bufsize no está entre el rango de MIN-MAX debe dar un error
     if (bufsize < MIN_BUFSIZE || bufsize > MAX_BUFSIZE) {
         fprintf(stderr, "ERROR: BUFSIZE debe ser mayor que 0 y menor que o igual a 1 MB\n");
         exit(EXIT_FAILURE);
     }
+    // El número de hilos tiene que estar entre 1 y MAX_HILOS
+    if (hilos < 1 || hilos > MAX_HILOS) {
+        fprintf(stderr, "ERROR: N debe estar entre 1 y %d\n", MAX_HILOS);
+        exit(EXIT_FAILURE);
+    }
     // Si no nos han pasado ninguna expresión regular debemos dar un error
     if (!regex_flag) {
         fprintf(stderr, "ERROR: REGEX vacía\n");
@@ -37,28 +315,160 @@ void verificarArgumentos(int bufsize, int regex_flag) {
     }
 }
 
+// Función para reservar memoria abortando si no hay
+void *reservar(void *ptr, size_t size) {
+    void *nuevo = realloc(ptr, size);
+    if (nuevo == NULL) {
+        fprintf(stderr, "ERROR: realloc()\n");
+        exit(EXIT_FAILURE);
+    }
+    return nuevo;
+}
+
+// Función para añadir un patrón a la lista de búsqueda
+void anadirPatron(struct Opciones *op, char *patron) {
+    op->patrones = reservar(op->patrones, (op->npatrones + 1) * sizeof(char *));
+    op->patrones[op->npatrones++] = patron;
+}
+
+// Función para leer los patrones de un fichero, uno por línea
+void leerPatrones(struct Opciones *op, const char *fichero) {
+    int fd = open(fichero, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "ERROR: no se puede abrir '%s'\n", fichero);
+        exit(EXIT_FAILURE);
+    }
+    size_t len = 0, capacidad = 4096;
+    char *datos = reservar(NULL, capacidad);
+    ssize_t bytes_read;
+    while ((bytes_read = read(fd, datos + len, capacidad - len - 1)) != 0) {
+        if (bytes_read == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "ERROR: read()\n");
+            exit(EXIT_FAILURE);
+        }
+        len += bytes_read;
+        if (capacidad - len == 1) {
+            capacidad *= 2;
+            datos = reservar(datos, capacidad);
+        }
+    }
+    close(fd);
+
+    // Los patrones apuntan al propio buffer, que no se libera
+    char *linea = datos;
+    datos[len] = '\0';
+    while (linea < datos + len) {
+        char *salto = memchr(linea, '\n', datos + len - linea);
+        if (salto != NULL) {
+            *salto = '\0';
+        }
+        anadirPatron(op, linea);
+        linea = salto != NULL ? salto + 1 : datos + len;
+    }
+}
+
+// Función para leer el número de líneas de contexto de -A, -B o -C
+int leerContexto(const char *arg) {
+    char *fin;
+    long n = strtol(arg, &fin, 10);
+    if (*arg == '\0' || *fin != '\0' || n < 0 || n > INT_MAX / 2) {
+        fprintf(stderr, "ERROR: NUM debe ser un número de líneas no negativo\n");
+        exit(EXIT_FAILURE);
+    }
+    return n;
+}
+
 // Función para procesar los argumentos de la línea de comandos
-void procesarArgumentos(int argc, char *argv[], regex_t *regex, int *bufsize, int *regex_flag, int *count_flag) {
+void procesarArgumentos(int argc, char *argv[], struct Opciones *op) {
+    // Opciones largas, sin versión corta
+    static const struct option largas[] = {
+        {"stats", no_argument, NULL, OPCION_STATS},
+        {NULL, 0, NULL, 0},
+    };
     int opt;
-    while ((opt = getopt(argc, argv, "r:s:vhc")) != -1) {
+    int contexto = -1; // -C, que no cambia lo que se haya dado con -A o -B
+    while ((opt = getopt_long(argc, argv, "r:e:f:s:vhcm:j:x:L:RHzA:B:C:", largas, NULL)) != -1) {
         switch (opt) {
         case 'r':
-            // Comprobar si la expresión regular está bien construida
-            if (regcomp(regex, optarg, REG_EXTENDED | REG_NEWLINE) != 0) {
-                fprintf(stderr, "ERROR: REGEX mal construida\n");
-                exit(EXIT_FAILURE);
-            }
-            *regex_flag = 1; // Marcar que se ha proporcionado la expresión regular
+        case 'e':
+            anadirPatron(op, optarg);
+            break;
+        case 'f':
+            leerPatrones(op, optarg);
             break;
         case 's':
-            *bufsize = atoi(optarg);
+            op->bufsize = atoi(optarg);
             break;
         case 'v':
             // Modo inverso: mostrar las líneas que NO coinciden con la expresión regular
-            *regex_flag = -1;
+            op->invertir = 1;
             break;
         case 'c':
-            *count_flag = 1;
+            op->count_flag = 1;
+            break;
+        case 'j':
+            op->hilos = atoi(optarg);
+            break;
+        case 'L':
+            op->maxlinea = atoll(optarg);
+            if (op->maxlinea < 0) {
+                fprintf(stderr, "ERROR: MAXLINEA no puede ser negativa\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'm':
+            // Forma de leer la entrada
+            if (strcmp(optarg, "auto") == 0) {
+                op->modo = MODO_AUTO;
+            } else if (strcmp(optarg, "mmap") == 0) {
+                op->modo = MODO_MMAP;
+            } else if (strcmp(optarg, "read") == 0) {
+                op->modo = MODO_READ;
+            } else {
+                fprintf(stderr, "ERROR: MODO debe ser auto, mmap o read\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'x':
+            // Motor de expresiones regulares
+            if (strcmp(optarg, "auto") == 0) {
+                op->motor = MOTOR_AUTO;
+            } else if (strcmp(optarg, "dfa") == 0) {
+                op->motor = MOTOR_DFA;
+            } else if (strcmp(optarg, "posix") == 0) {
+                op->motor = MOTOR_POSIX;
+            } else {
+                fprintf(stderr, "ERROR: MOTOR debe ser auto, dfa o posix\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'R':
+            op->recursivo = 1;
+            break;
+        case 'H':
+            op->nombres = 1;
+            break;
+        case 'z':
+#ifndef MINIGREP_ZLIB
+            fprintf(stderr, "ERROR: minigrep se ha compilado sin zlib (-DMINIGREP_ZLIB -lz)\n");
+            exit(EXIT_FAILURE);
+#endif
+            op->descomprimir = 1;
+            break;
+        case 'A':
+            op->despues = leerContexto(optarg);
+            break;
+        case 'B':
+            op->antes = leerContexto(optarg);
+            break;
+        case 'C':
+            contexto = leerContexto(optarg);
+            break;
+        case OPCION_STATS:
+            estadisticas.activas = 1;
             break;
         case 'h':
             // Opciones de ayuda
@@ -68,217 +478,2811 @@ void procesarArgumentos(int argc, char *argv[], regex_t *regex, int *bufsize, in
             printUsage(EXIT_FAILURE); // Muestra cómo usar el programa y sale con error
         }
     }
-}
+    if (op->npatrones > 0) {
+        op->regex_flag = op->invertir ? -1 : 1; // Marcar que se ha proporcionado la expresión regular
+    }
+    if (op->antes < 0) {
+        op->antes = contexto;
+    }
+    if (op->despues < 0) {
+        op->despues = contexto;
+    }
+    if (op->antes >= 0 || op->despues >= 0) {
+        // Con una de las dos opciones, la otra vale 0
+        op->antes = op->antes < 0 ? 0 : op->antes;
+        op->despues = op->despues < 0 ? 0 : op->despues;
+    }
 
-// Función para agregar datos leídos al buffer temporal
-void addlectura(char *temp_buffer, ssize_t *btemp_len, char *read_buffer, ssize_t bytes_read) {
-    // Copiamos lo que leemos al buffer temporal
-    for (ssize_t i = 0; i < bytes_read; ++i) {
-        temp_buffer[*btemp_len + i] = read_buffer[i];
+    // Lo que queda son las rutas
+    op->rutas = argv + optind;
+    op->nrutas = argc - optind;
+    if (op->nrutas > 1 || op->recursivo) {
+        op->nombres = 1;
     }
-    *btemp_len += bytes_read;
 }
 
-// Función para ajustar el buffer temporal eliminando las líneas ya procesadas
-void ajustarbuffer(char *temp_buffer, ssize_t *btemp_len, char *line_start, ssize_t temp_buffer_size) {
-    // Calcular la cantidad de caracteres no procesados
-    ssize_t remaining_chars = *btemp_len - (line_start - temp_buffer);
+// Función para leer el reloj monotónico en nanosegundos
+uint64_t relojNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-    // Mover los caracteres no procesados hacia el final del buffer temporal
-    for (ssize_t i = 0; i < remaining_chars; ++i) {
-        temp_buffer[i] = line_start[i];
-    }
+// Función para sumar a un contador de las estadísticas desde cualquier hilo
+void sumarStats(uint64_t *contador, uint64_t valor) {
+    __atomic_fetch_add(contador, valor, __ATOMIC_RELAXED);
+}
 
-    // Actualizar la longitud del buffer temporal
-    *btemp_len = remaining_chars;
+// Función para sumar a una etapa el tiempo transcurrido desde t0. Devuelve ese tiempo
+uint64_t medirEtapa(int etapa, uint64_t t0) {
+    uint64_t ns = relojNs() - t0;
+    sumarStats(&estadisticas.ns[etapa], ns);
+    return ns;
+}
+
+// Función para hacer read() contando la llamada y su tiempo si hay estadísticas
+ssize_t leer(int fd, void *buf, size_t len) {
+    if (!estadisticas.activas) {
+        return read(fd, buf, len);
+    }
+    uint64_t t0 = relojNs();
+    ssize_t bytes_read = read(fd, buf, len);
+    medirEtapa(ETAPA_LECTURA, t0);
+    sumarStats(&estadisticas.lecturas, 1);
+    if (bytes_read > 0) {
+        sumarStats(&estadisticas.bytes_leidos, bytes_read);
+    }
+    return bytes_read;
+}
 
+// Función para proyectar en memoria un fichero que se va a recorrer una sola vez de
+// principio a fin. Devuelve MAP_FAILED si no se puede
+char *proyectar(int fd, size_t size) {
+    uint64_t t0 = estadisticas.activas ? relojNs() : 0;
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+        posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+        madvise(map, size, MADV_HUGEPAGE);
+#endif
+    }
+    if (estadisticas.activas) {
+        medirEtapa(ETAPA_PROYECCION, t0);
+    }
+    return map;
 }
 
-// Función para ajustar los trozos de datos en el buffer temporal
-void ajustarTrozos(char *temp_buffer, ssize_t *btemp_len, char *line_start, ssize_t bytes_read, char *read_buffer) {
-    // Comprobar si quedan caracteres sin procesar para meterlos al temp_buffer
-    if (line_start < read_buffer + bytes_read) {
-        // Calcular la cantidad de caracteres sin procesar
-        ssize_t remaining_chars = read_buffer + bytes_read - line_start;
+#ifdef MINIGREP_ZLIB
+// Función para saber si unos datos empiezan por la cabecera de gzip
+int esGzip(const unsigned char *p, size_t len) {
+    return len >= 2 && p[0] == 0x1f && p[1] == 0x8b;
+}
 
-        // Copiar los caracteres no procesados al temp_buffer
-        for (ssize_t i = 0; i < remaining_chars; ++i) {
-            temp_buffer[*btemp_len + i] = line_start[i];
+// Función para mirar si la entrada estándar está comprimida con gzip. Los ficheros regulares
+// se miran con pread() sin moverse; del resto se leen los dos primeros bytes, que después se
+// devuelven con la entrada
+void detectarGzip(int es_regular) {
+    if (es_regular) {
+        off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+        ssize_t n = pread(STDIN_FILENO, entrada.cabecera, sizeof(entrada.cabecera), offset < 0 ? 0 : offset);
+        entrada.gzip = n > 0 && esGzip(entrada.cabecera, n);
+        return;
+    }
+    while (entrada.ncabecera < sizeof(entrada.cabecera)) {
+        ssize_t n = leer(STDIN_FILENO, entrada.cabecera + entrada.ncabecera, sizeof(entrada.cabecera) - entrada.ncabecera);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break; // El error, si lo hay, lo vuelve a dar la siguiente lectura
         }
-        // Actualizar la longitud del buffer temporal
-        *btemp_len += remaining_chars;
+        entrada.ncabecera += n;
     }
+    entrada.gzip = esGzip(entrada.cabecera, entrada.ncabecera);
 }
 
-// Función para escribir en el flujo de salida
-ssize_t escribir(int fd, char *buf, size_t size) {
-    ssize_t num_written, size_left = size;
-    char *buf_left = buf;
-    while (size_left > 0 && (num_written = write(fd, buf_left, size_left)) != -1) {
-        size_left -= num_written;
-        buf_left += num_written;
+// Función para preparar la descompresión de la entrada, empezando por los bytes ya leídos
+void iniciarGzip(void) {
+    entrada.comprimido = reservar(NULL, TAM_GZIP);
+    memcpy(entrada.comprimido, entrada.cabecera, entrada.ncabecera);
+    entrada.z.next_in = entrada.comprimido;
+    entrada.z.avail_in = entrada.ncabecera;
+    entrada.usados = entrada.ncabecera;
+    if (inflateInit2(&entrada.z, 16 + MAX_WBITS) != Z_OK) {
+        fprintf(stderr, "ERROR: inflateInit2()\n");
+        exit(EXIT_FAILURE);
     }
-    // Verificar errores durante la escritura
-    return num_written == -1 ? -1 : size;
 }
 
-// Función para procesar las líneas en el buffer (combinada)
-void procesarLineaBuffer(regex_t *regex, int regex_flag, char *line_start, char *buffer, ssize_t buffer_size, ssize_t bytes_read, char *temp_buffer, ssize_t *btemp_len, char *writeBuffer, ssize_t temp_buffer_size, int *match_count, int count_flag, int is_temp_buffer) {
+// Función para terminar la descompresión de la entrada
+void terminarGzip(void) {
+    inflateEnd(&entrada.z);
+    free(entrada.comprimido);
+}
 
-    char *line_end = strchr(line_start, '\n');
-    
-    while (line_end != NULL) {
-        *line_end = '\0'; // Apunto al final de la cadena
-        int match = regexec(regex, line_start, 0, NULL, 0); // Compruebo si hay coincidencia
-        
-        if ((match == 0 && regex_flag != -1) || (match != 0 && regex_flag == -1)) {
-            (*match_count)++;
-            if (!count_flag) {
-                // Copiar la cadena coincidente al buffer de escritura
-                char *write_ptr = writeBuffer;
-                char *read_ptr = line_start;
-                
-                while (*read_ptr != '\0' && *read_ptr != '\n') {
-                    *write_ptr++ = *read_ptr++;
-                }
-                *write_ptr = '\n'; // Añadir un carácter de nueva línea después de la cadena coincidente
-                ssize_t num_written = escribir(STDOUT_FILENO, writeBuffer, write_ptr - writeBuffer + 1); // Escribir
-                if (num_written < 0) {
-                    fprintf(stderr, "ERROR: write()\n");
-                    exit(EXIT_FAILURE);
+// Función para descomprimir una entrada gzip directamente en el buffer de quien lee. Como
+// read(), devuelve 0 al final y -1 si falla la lectura de fd; con fd -1 no se lee nada y lo
+// comprimido es lo que ya hay en z.next_in. Los miembros concatenados se descomprimen seguidos,
+// como hace zcat, y lo que no sea gzip detrás de un miembro completo se ignora. Si la entrada
+// está truncada o dañada también devuelve -1, con el motivo en e->error
+ssize_t inflarEntrada(struct Entrada *e, int fd, void *buf, size_t len) {
+    z_stream *z = &e->z;
+    z->next_out = buf;
+    z->avail_out = len < UINT_MAX ? len : UINT_MAX;
+    size_t pedido = z->avail_out;
+    while (z->avail_out > 0 && !e->terminada) {
+        if (z->avail_in == 0 && !e->fin_lectura) {
+            ssize_t bytes_read = leer(fd, e->comprimido, TAM_GZIP);
+            if (bytes_read == -1) {
+                if (errno == EINTR) {
+                    continue;
                 }
+                return -1;
+            }
+            e->fin_lectura = bytes_read == 0;
+            z->next_in = e->comprimido;
+            z->avail_in = bytes_read;
+        }
+        if (z->avail_in == 0) {
+            if (!e->miembro_completo) {
+                e->error = "la entrada gzip está truncada";
+                return -1;
             }
+            e->terminada = 1;
+            break;
         }
-        
-        line_start = line_end + 1; // Ajustar índices para comprobar la siguiente cadena
-        line_end = strchr(line_start, '\n');
+        uint64_t t0 = estadisticas.activas ? relojNs() : 0;
+        int r = inflate(z, Z_NO_FLUSH);
+        if (estadisticas.activas) {
+            medirEtapa(ETAPA_DESCOMPRESION, t0);
+        }
+        if (r == Z_STREAM_END) {
+            inflateReset(z);
+            e->miembro_completo = 1;
+        } else if (r == Z_DATA_ERROR && e->miembro_completo) {
+            e->terminada = 1; // Basura detrás del último miembro
+        } else if (r == Z_OK) {
+            e->miembro_completo = 0;
+        } else if (r != Z_BUF_ERROR) {
+            e->error = "la entrada gzip está dañada";
+            return -1;
+        }
+    }
+    return pedido - z->avail_out;
+}
+
+// Función para descomprimir la entrada estándar gzip. Si está truncada o dañada se termina
+ssize_t leerGzip(void *buf, size_t len) {
+    ssize_t n = inflarEntrada(&entrada, STDIN_FILENO, buf, len);
+    if (n == -1 && entrada.error != NULL) {
+        fprintf(stderr, "ERROR: %s\n", entrada.error);
+        exit(EXIT_FAILURE);
+    }
+    return n;
+}
+#endif
+
+// Función para leer de la entrada estándar como read(), descomprimiéndola si es gzip y
+// devolviendo antes los bytes que se leyeron para detectarlo
+ssize_t leerEntrada(void *buf, size_t len) {
+#ifdef MINIGREP_ZLIB
+    if (entrada.gzip) {
+        return leerGzip(buf, len);
+    }
+    if (entrada.usados < entrada.ncabecera) {
+        size_t n = entrada.ncabecera - entrada.usados < len ? entrada.ncabecera - entrada.usados : len;
+        memcpy(buf, entrada.cabecera + entrada.usados, n);
+        entrada.usados += n;
+        return n;
+    }
+#endif
+    return leer(STDIN_FILENO, buf, len);
+}
+
+// Función para saber cuántos bytes pedir a leerEntrada() con hueco libre en el buffer. La
+// entrada comprimida se descomprime de una vez en todo el hueco en vez de en BUFSIZE bytes
+size_t tamLectura(int bufsize, size_t hueco) {
+#ifdef MINIGREP_ZLIB
+    if (entrada.gzip) {
+        return hueco;
     }
-    
-    if (is_temp_buffer) {
-        if (*btemp_len > MAX_LINE_SIZE) {
-            fprintf(stderr, "ERROR: Línea demasiado larga\n");
+#endif
+    (void)hueco;
+    return bufsize;
+}
+
+// Función para escribir un vector de trozos, reintentando las escrituras parciales
+// y las interrumpidas por señales
+void escribirVector(int fd, struct iovec *iov, int niov) {
+    while (niov > 0) {
+        uint64_t t0 = estadisticas.activas ? relojNs() : 0;
+        ssize_t num_written = writev(fd, iov, niov < IOV_MAX ? niov : IOV_MAX);
+        if (estadisticas.activas) {
+            ns_escritura_hilo += medirEtapa(ETAPA_ESCRITURA, t0);
+            sumarStats(&estadisticas.escrituras, 1);
+            if (num_written > 0) {
+                sumarStats(&estadisticas.bytes_escritos, num_written);
+            }
+        }
+        if (num_written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EPIPE) {
+                // Quien leía la salida ya no está: se termina sin más mensajes
+                exit(EXIT_FAILURE);
+            }
+            fprintf(stderr, "ERROR: write()\n");
             exit(EXIT_FAILURE);
         }
-        // Borrar las cadenas que ya han sido procesadas
-        ajustarbuffer(temp_buffer, btemp_len, line_start, temp_buffer_size);
+        // Saltar los trozos escritos enteros y ajustar el que se quedó a medias
+        while (niov > 0 && (size_t)num_written >= iov->iov_len) {
+            num_written -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if (niov > 0) {
+            iov->iov_base = (char *)iov->iov_base + num_written;
+            iov->iov_len -= num_written;
+        }
+    }
+}
+
+// Función para inicializar un acumulador de salida
+void iniciarSalida(struct Salida *s, int fd, size_t limite) {
+    memset(s, 0, sizeof(*s));
+    s->fd = fd;
+    s->limite = limite;
+}
+
+// Función para escribir todo lo acumulado
+void vaciarSalida(struct Salida *s) {
+    if (s->niov > 0) {
+        escribirVector(s->fd, s->iov, s->niov);
+    }
+    s->niov = 0;
+    s->bytes = 0;
+}
+
+// Función para añadir un trozo [inicio, fin) al acumulador tal cual
+void anadirTrozo(struct Salida *s, const char *inicio, const char *fin) {
+    size_t len = fin - inicio;
+    struct iovec *ultimo = s->niov > 0 ? &s->iov[s->niov - 1] : NULL;
+    if (ultimo != NULL && (const char *)ultimo->iov_base + ultimo->iov_len == inicio) {
+        // Líneas consecutivas en la entrada: se amplía el trozo anterior
+        ultimo->iov_len += len;
+    } else {
+        if (s->niov == s->cap) {
+            s->cap = s->cap == 0 ? 64 : s->cap * 2;
+            s->iov = reservar(s->iov, s->cap * sizeof(struct iovec));
+        }
+        s->iov[s->niov].iov_base = (char *)inicio;
+        s->iov[s->niov].iov_len = len;
+        s->niov++;
+    }
+    s->bytes += len;
+}
+
+// Función para añadir un bloque de líneas aceptadas [inicio, fin) al acumulador,
+// añadiendo el '\n' que le falte a la última línea de la entrada
+void anadirSalida(struct Salida *s, const char *inicio, const char *fin) {
+    if (s->prefijo == NULL) {
+        anadirTrozo(s, inicio, fin);
     } else {
-        // Ajustar los trozos en el buffer temporal
-        ajustarTrozos(temp_buffer, btemp_len, line_start, bytes_read, buffer);
+        // Con prefijo el bloque se parte en líneas
+        const char *p = inicio;
+        while (p < fin) {
+            const char *salto = memchr(p, '\n', fin - p);
+            const char *corte = salto != NULL ? salto + 1 : fin;
+            anadirTrozo(s, s->prefijo, s->prefijo + s->prefijo_len);
+            anadirTrozo(s, p, corte);
+            p = corte;
+        }
+    }
+    if (fin[-1] != '\n') {
+        anadirTrozo(s, "\n", "\n" + 1);
+    }
+    if (s->fd >= 0 && (s->bytes >= s->limite || s->niov >= IOV_MAX)) {
+        vaciarSalida(s);
     }
 }
 
-// Función para procesar la cadena final en el buffer temporal
-void procesarCadenaFinal(regex_t *regex, int regex_flag, char *line_start, char *temp_buffer, ssize_t *btemp_len, char *writeBuffer, int *match_count, int count_flag) {
+// Función para añadir líneas de contexto, que llevan su propio prefijo
+void anadirContexto(struct Salida *s, const char *inicio, const char *fin) {
+    const char *prefijo = s->prefijo;
+    s->prefijo = s->prefijo_contexto;
+    anadirSalida(s, inicio, fin);
+    s->prefijo = prefijo;
+}
 
-    line_start = temp_buffer;
-    temp_buffer[*btemp_len] = '\n';  // Añadir un carácter de nueva línea al final del buffer temporal
-    (*btemp_len)++;
-    if (*btemp_len > MAX_LINE_SIZE) {
-        fprintf(stderr, "ERROR: Línea demasiado larga\n");
-        exit(EXIT_FAILURE);
+// Función para comprobar si alguna expresión reconoce la línea [inicio, fin), sin necesidad
+// de terminarla con '\0'
+int lineaCoincide(regex_t *regex, int nregex, const char *inicio, const char *fin) {
+    for (int i = 0; i < nregex; i++) {
+        regmatch_t limites;
+        limites.rm_so = 0;
+        limites.rm_eo = fin - inicio;
+        if (regexec(&regex[i], inicio, 1, &limites, REG_STARTEND) == 0) {
+            return 1;
+        }
     }
+    return 0;
+}
 
-    int match = regexec(regex, line_start, 0, NULL, 0); // Comprobar si hay coincidencia en el buffer temporal
-    
-    if ((match == 0 && regex_flag != -1) || (match != 0 && regex_flag == -1)) {
-        (*match_count)++;
-        if (!count_flag) {
-            // Copiar la cadena coincidente al buffer de escritura
-            char *write_ptr = writeBuffer;
-            char *read_ptr = line_start;
-            
-            while (*read_ptr != '\0' && *read_ptr != '\n') {
-                *write_ptr++ = *read_ptr++;
-            }
-            
-            *write_ptr = '\n'; // Añadir un carácter de nueva línea después de la cadena coincidente
-            ssize_t num_written = escribir(STDOUT_FILENO, writeBuffer, write_ptr - writeBuffer + 1); // Escribir 
-            if (num_written < 0) {
-                fprintf(stderr, "ERROR: write()\n");
-                exit(EXIT_FAILURE);
+// Función para buscar el siguiente '\n' en [p, end) comparando 8 bytes a la vez
+const char *buscarSaltoEscalar(const char *p, const char *end) {
+    const uint64_t unos = 0x0101010101010101ULL;
+    const uint64_t altos = 0x8080808080808080ULL;
+    const uint64_t saltos = unos * '\n';
+    while (end - p >= 8) {
+        uint64_t palabra;
+        memcpy(&palabra, p, 8);
+        palabra ^= saltos; // Los bytes que eran '\n' pasan a valer 0
+        if (((palabra - unos) & ~palabra & altos) != 0) {
+            break;
+        }
+        p += 8;
+    }
+    for (; p < end; p++) {
+        if (*p == '\n') {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// Función para contar los '\n' de [p, end) de 8 en 8 bytes: cada byte que era '\n' deja
+// encendido exactamente su bit alto, sin acarreos entre bytes
+long long contarSaltosEscalar(const char *p, const char *end) {
+    const uint64_t bajos = 0x7f7f7f7f7f7f7f7fULL;
+    const uint64_t saltos = 0x0101010101010101ULL * '\n';
+    long long n = 0;
+    while (end - p >= 8) {
+        uint64_t palabra;
+        memcpy(&palabra, p, 8);
+        palabra ^= saltos;
+        n += __builtin_popcountll(~(((palabra & bajos) + bajos) | palabra) & ~bajos);
+        p += 8;
+    }
+    for (; p < end; p++) {
+        n += *p == '\n';
+    }
+    return n;
+}
+
+// Función para buscar un literal en [p, end)
+const char *buscarLiteralEscalar(const char *p, const char *end, const char *literal, size_t len) {
+    return memmem(p, end - p, literal, len);
+}
+
+#ifdef MINIGREP_X86
+// Función para buscar el siguiente '\n' en [p, end) de 16 en 16 bytes con SSE2
+__attribute__((target("sse2")))
+const char *buscarSaltoSse2(const char *p, const char *end) {
+    const __m128i saltos = _mm_set1_epi8('\n');
+    while (end - p >= 16) {
+        __m128i bloque = _mm_loadu_si128((const __m128i *)p);
+        int mascara = _mm_movemask_epi8(_mm_cmpeq_epi8(bloque, saltos));
+        if (mascara != 0) {
+            return p + __builtin_ctz(mascara);
+        }
+        p += 16;
+    }
+    return buscarSaltoEscalar(p, end);
+}
+
+// Función para buscar el siguiente '\n' en [p, end) de 64 en 64 bytes con AVX2
+__attribute__((target("avx2")))
+const char *buscarSaltoAvx2(const char *p, const char *end) {
+    const __m256i saltos = _mm256_set1_epi8('\n');
+    while (end - p >= 64) {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), saltos);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 32)), saltos);
+        if (!_mm256_testz_si256(_mm256_or_si256(a, b), _mm256_or_si256(a, b))) {
+            uint64_t mascara = (uint32_t)_mm256_movemask_epi8(a) | (uint64_t)(uint32_t)_mm256_movemask_epi8(b) << 32;
+            return p + __builtin_ctzll(mascara);
+        }
+        p += 64;
+    }
+    return buscarSaltoSse2(p, end);
+}
+
+// Función para contar los '\n' de [p, end) con SSE2 y popcount de las máscaras
+__attribute__((target("sse2")))
+long long contarSaltosSse2(const char *p, const char *end) {
+    const __m128i saltos = _mm_set1_epi8('\n');
+    long long n = 0;
+    while (end - p >= 16) {
+        n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), saltos)));
+        p += 16;
+    }
+    return n + contarSaltosEscalar(p, end);
+}
+
+// Función para contar los '\n' de [p, end) de 64 en 64 bytes con AVX2 y popcnt
+__attribute__((target("avx2,popcnt")))
+long long contarSaltosAvx2(const char *p, const char *end) {
+    const __m256i saltos = _mm256_set1_epi8('\n');
+    long long n = 0;
+    while (end - p >= 64) {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), saltos);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 32)), saltos);
+        uint64_t mascara = (uint32_t)_mm256_movemask_epi8(a) | (uint64_t)(uint32_t)_mm256_movemask_epi8(b) << 32;
+        n += __builtin_popcountll(mascara);
+        p += 64;
+    }
+    return n + contarSaltosSse2(p, end);
+}
+
+// Función para buscar un literal en [p, end) con SSE2: se filtran las posiciones en las
+// que coinciden el primer y el último byte y solo en esas se compara el resto
+__attribute__((target("sse2")))
+const char *buscarLiteralSse2(const char *p, const char *end, const char *literal, size_t len) {
+    const __m128i primero = _mm_set1_epi8(literal[0]);
+    const __m128i ultimo = _mm_set1_epi8(literal[len - 1]);
+    while (end - p >= (ptrdiff_t)(len + 15)) {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), primero);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + len - 1)), ultimo);
+        unsigned mascara = _mm_movemask_epi8(_mm_and_si128(a, b));
+        while (mascara != 0) {
+            int i = __builtin_ctz(mascara);
+            if (memcmp(p + i + 1, literal + 1, len - 1) == 0) {
+                return p + i;
             }
+            mascara &= mascara - 1;
         }
+        p += 16;
     }
+    return buscarLiteralEscalar(p, end, literal, len);
 }
 
-// Función principal que ejecuta la lógica principal del programa
-void minigrep(regex_t *regex, int regex_flag, int bufsize, int count_flag) {
-    // Variables
-    ssize_t bytes_read;
-    ssize_t btemp_len = 0;
-    ssize_t temp_buffer_size = MAX_LINE_SIZE;
-    int match_count = 0;
+// Función para buscar un literal en [p, end) con AVX2, con el mismo filtro que la versión SSE2
+__attribute__((target("avx2")))
+const char *buscarLiteralAvx2(const char *p, const char *end, const char *literal, size_t len) {
+    const __m256i primero = _mm256_set1_epi8(literal[0]);
+    const __m256i ultimo = _mm256_set1_epi8(literal[len - 1]);
+    while (end - p >= (ptrdiff_t)(len + 31)) {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), primero);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + len - 1)), ultimo);
+        uint32_t mascara = _mm256_movemask_epi8(_mm256_and_si256(a, b));
+        while (mascara != 0) {
+            int i = __builtin_ctz(mascara);
+            if (memcmp(p + i + 1, literal + 1, len - 1) == 0) {
+                return p + i;
+            }
+            mascara &= mascara - 1;
+        }
+        p += 32;
+    }
+    return buscarLiteralSse2(p, end, literal, len);
+}
+#endif
 
-    // Inicializo buffers
-    char *read_buffer = (char *)malloc(bufsize * sizeof(char));
-    if (read_buffer == NULL) {
-        fprintf(stderr, "ERROR: malloc()\n");
-        exit(EXIT_FAILURE);
+// Implementaciones elegidas en tiempo de ejecución según la CPU
+const char *(*buscarSalto)(const char *, const char *) = buscarSaltoEscalar;
+const char *(*buscarLiteral)(const char *, const char *, const char *, size_t) = buscarLiteralEscalar;
+long long (*contarSaltos)(const char *, const char *) = contarSaltosEscalar;
+
+// Función para elegir las versiones vectoriales que soporte el procesador
+void elegirSimd(void) {
+#ifdef MINIGREP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        buscarSalto = buscarSaltoAvx2;
+        buscarLiteral = buscarLiteralAvx2;
+        contarSaltos = contarSaltosAvx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        buscarSalto = buscarSaltoSse2;
+        buscarLiteral = buscarLiteralSse2;
+        contarSaltos = contarSaltosSse2;
     }
-    char *writeBuffer = (char *)malloc(bufsize * sizeof(char));
-    if (writeBuffer == NULL) {
-        fprintf(stderr, "ERROR: malloc()\n");
-        free(read_buffer);
-        exit(EXIT_FAILURE);
+#endif
+}
+
+int parseAlt(struct Parser *ps);
+void liberarDfa(struct Dfa *d);
+
+// Función para crear un nodo del árbol sintáctico de la expresión
+int nuevoNodo(struct Parser *ps, int tipo, int a, int b) {
+    if (ps->nnodos == ps->cap) {
+        ps->cap = ps->cap == 0 ? 64 : ps->cap * 2;
+        ps->nodos = reservar(ps->nodos, ps->cap * sizeof(struct Nodo));
     }
-    char *temp_buffer = (char *)malloc(temp_buffer_size * sizeof(char));
-    if (temp_buffer == NULL) {
-        fprintf(stderr, "ERROR: malloc()\n");
-        free(read_buffer);
-        free(writeBuffer);
-        exit(EXIT_FAILURE);
+    struct Nodo *n = &ps->nodos[ps->nnodos];
+    memset(n, 0, sizeof(*n));
+    n->tipo = tipo;
+    n->a = a;
+    n->b = b;
+    return ps->nnodos++;
+}
+
+// Función para crear un conjunto de bytes vacío
+int nuevoConjunto(struct Parser *ps) {
+    if (ps->nconj == ps->capconj) {
+        ps->capconj = ps->capconj == 0 ? 16 : ps->capconj * 2;
+        ps->conj = reservar(ps->conj, ps->capconj * sizeof(*ps->conj));
     }
+    memset(ps->conj[ps->nconj], 0, sizeof(*ps->conj));
+    return ps->nconj++;
+}
 
-    // Punteros que marcaran el principio y final de las lineas
-    char *line_start;
-    
-    // While(que no haya leido todo)
-    while ((bytes_read = read(STDIN_FILENO, read_buffer, bufsize)) > 0) {
-        if(btemp_len > 0) { // Caso para cuando tenemos trozos en el buffer temporal
-            // Añado lo leido al buffer temporal 
-            addlectura(temp_buffer, &btemp_len, read_buffer, bytes_read);
+// Función para crear un nodo que reconoce un solo byte
+int nodoByte(struct Parser *ps, unsigned char c) {
+    int k = nuevoConjunto(ps);
+    ps->conj[k][c >> 3] |= 1 << (c & 7);
+    int n = nuevoNodo(ps, NODO_CLASE, -1, -1);
+    ps->nodos[n].clase = k;
+    return n;
+}
 
-            // Proceso el buffer temporal
-            line_start = temp_buffer;
-            procesarLineaBuffer(regex, regex_flag, line_start, temp_buffer, bufsize, bytes_read, temp_buffer, &btemp_len, writeBuffer, temp_buffer_size, &match_count, count_flag, 1);
-        } else { // Caso para cuando tengo todo en el buffer de lectura y no necesito el buffer temporal
-            line_start = read_buffer;
-            // Proceso el buffer de lectura
-            procesarLineaBuffer(regex, regex_flag, line_start, read_buffer, bufsize, bytes_read, temp_buffer, &btemp_len, writeBuffer, temp_buffer_size, &match_count, count_flag, 0);
+// Función para añadir a un conjunto los bytes de una clase con nombre como [:alpha:]
+int anadirClaseNombre(uint8_t *conj, const char *nombre, size_t len) {
+    static const char *nombres[] = {"alpha", "digit", "alnum", "upper", "lower", "space",
+                                    "blank", "punct", "print", "graph", "cntrl", "xdigit"};
+    int (*funciones[])(int) = {isalpha, isdigit, isalnum, isupper, islower, isspace,
+                               isblank, ispunct, isprint, isgraph, iscntrl, isxdigit};
+    for (size_t i = 0; i < sizeof(nombres) / sizeof(nombres[0]); i++) {
+        if (strlen(nombres[i]) == len && strncmp(nombres[i], nombre, len) == 0) {
+            for (int c = 0; c < 256; c++) {
+                if (funciones[i](c)) {
+                    conj[c >> 3] |= 1 << (c & 7);
+                }
+            }
+            return 1;
         }
     }
+    return 0;
+}
 
-    // Comprobar si hubo un error de lectura
-    if (bytes_read == -1) {
-        fprintf(stderr, "ERROR: read()\n");
-        free(read_buffer);
-        free(writeBuffer);
-        free(temp_buffer);
-        exit(EXIT_FAILURE);
+// Función para leer un carácter de una expresión entre corchetes, incluidos [.x.] y [=x=]
+int leerCaracterCorchetes(struct Parser *ps) {
+    if (ps->p[0] == '[' && (ps->p[1] == '.' || ps->p[1] == '=')) {
+        // Solo se admiten símbolos de un carácter
+        char cierre = ps->p[1];
+        if (ps->p[2] == '\0' || ps->p[3] != cierre || ps->p[4] != ']') {
+            ps->error = 1;
+            return 0;
+        }
+        unsigned char c = ps->p[2];
+        ps->p += 5;
+        return c;
     }
+    return (unsigned char)*ps->p++;
+}
 
-    // Comprobar el caso de que queden cadenas por procesar sin /n al final
-    if (btemp_len > 0) {
-        procesarCadenaFinal(regex, regex_flag, line_start, temp_buffer, &btemp_len, writeBuffer, &match_count, count_flag);
+// Función para analizar una expresión entre corchetes
+int parseCorchetes(struct Parser *ps) {
+    int k = nuevoConjunto(ps);
+    uint8_t *conj = ps->conj[k];
+    int negado = 0;
+    ps->p++; // '['
+    if (*ps->p == '^') {
+        negado = 1;
+        ps->p++;
     }
-    if (count_flag) {
-        printf("%d\n", match_count);
+    int primero = 1; // Un ']' al principio es un carácter más
+    while (primero || *ps->p != ']') {
+        primero = 0;
+        if (*ps->p == '\0') {
+            ps->error = 1;
+            return -1;
+        }
+        if (ps->p[0] == '[' && ps->p[1] == ':') {
+            const char *nombre = ps->p + 2;
+            const char *fin = strstr(nombre, ":]");
+            conj = ps->conj[k];
+            if (fin == NULL || !anadirClaseNombre(conj, nombre, fin - nombre)) {
+                ps->error = 1;
+                return -1;
+            }
+            ps->p = fin + 2;
+            continue;
+        }
+        int desde = leerCaracterCorchetes(ps);
+        int hasta = desde;
+        if (ps->p[0] == '-' && ps->p[1] != ']' && ps->p[1] != '\0') {
+            ps->p++;
+            hasta = leerCaracterCorchetes(ps);
+        }
+        if (ps->error || hasta < desde) {
+            ps->error = 1;
+            return -1;
+        }
+        conj = ps->conj[k];
+        for (int c = desde; c <= hasta; c++) {
+            conj[c >> 3] |= 1 << (c & 7);
+        }
+    }
+    ps->p++; // ']'
+    conj = ps->conj[k];
+    if (negado) {
+        for (int i = 0; i < 32; i++) {
+            conj[i] = ~conj[i];
+        }
+        conj['\n' >> 3] &= ~(1 << ('\n' & 7)); // REG_NEWLINE: [^...] no reconoce el salto de línea
     }
+    int n = nuevoNodo(ps, NODO_CLASE, -1, -1);
+    ps->nodos[n].clase = k;
+    return n;
+}
 
-    // Liberar la memoria de los buffers
-    free(read_buffer);
-    free(writeBuffer);
+// Función para analizar un elemento simple de la expresión
+int parseAtomo(struct Parser *ps) {
+    char c = *ps->p;
+    if (c == '(') {
+        ps->p++;
+        int n = parseAlt(ps);
+        if (*ps->p != ')') {
+            ps->error = 1;
+            return -1;
+        }
+        ps->p++;
+        return n;
+    }
+    if (c == '[') {
+        return parseCorchetes(ps);
+    }
+    if (c == '.') {
+        // Como en glibc, el punto no reconoce ni el salto de línea ni el byte nulo
+        ps->p++;
+        int k = nuevoConjunto(ps);
+        memset(ps->conj[k], 0xff, 32);
+        ps->conj[k][0] &= ~1;
+        ps->conj[k]['\n' >> 3] &= ~(1 << ('\n' & 7));
+        int n = nuevoNodo(ps, NODO_CLASE, -1, -1);
+        ps->nodos[n].clase = k;
+        return n;
+    }
+    if (c == '^' || c == '$') {
+        ps->p++;
+        return nuevoNodo(ps, c == '^' ? NODO_INICIO : NODO_FIN, -1, -1);
+    }
+    if (c == '*' || c == '+' || c == '?' || c == '{' || c == ')') {
+        // Casos dudosos que es mejor dejar a regexec()
+        ps->error = 1;
+        return -1;
+    }
+    if (c == '\\') {
+        c = ps->p[1];
+        if (c == '\0' || (c >= '1' && c <= '9') || strchr("wWsSbB<>`'", c) != NULL) {
+            // Referencias hacia atrás y extensiones GNU
+            ps->error = 1;
+            return -1;
+        }
+        ps->p += 2;
+        return nodoByte(ps, c);
+    }
+    ps->p++;
+    return nodoByte(ps, c);
 }
 
-// Función principal del programa
-int main(int argc, char *argv[]) {
-    int regex_flag = 0;
-    int count_flag = 0;
-    regex_t regex;                 // Variables para la expresion regular
-    int bufsize = DEFAULT_BUFSIZE; // Tamaño del buffer por defecto que usaremos para leer y escribir
-
-    procesarArgumentos(argc, argv, &regex, &bufsize, &regex_flag, &count_flag);  // Coger parametros con getopt
-    verificarArgumentos(bufsize, regex_flag);                                   // Comprobar si los parametros estan en nuestro rango
-    minigrep(&regex, regex_flag, bufsize, count_flag);                          // Procesar lineas
+// Función para leer un número de un intervalo {m,n}; devuelve -1 si no hay
+int leerNumero(struct Parser *ps) {
+    if (*ps->p < '0' || *ps->p > '9') {
+        return -1;
+    }
+    int n = 0;
+    while (*ps->p >= '0' && *ps->p <= '9') {
+        n = n * 10 + (*ps->p++ - '0');
+        if (n > RE_DUP_MAX) {
+            ps->error = 1;
+        }
+    }
+    return n;
+}
+
+// Función para analizar un elemento seguido de sus repeticiones
+int parseRepetir(struct Parser *ps) {
+    int n = parseAtomo(ps);
+    while (!ps->error && (*ps->p == '*' || *ps->p == '+' || *ps->p == '?' || *ps->p == '{')) {
+        int tipo = ps->nodos[n].tipo;
+        if (tipo == NODO_INICIO || tipo == NODO_FIN) {
+            ps->error = 1;
+            return -1;
+        }
+        int min = 0, max = -1;
+        char c = *ps->p++;
+        if (c == '+') {
+            min = 1;
+        } else if (c == '?') {
+            max = 1;
+        } else if (c == '{') {
+            min = leerNumero(ps);
+            if (*ps->p == ',') {
+                ps->p++;
+                max = leerNumero(ps);
+            } else {
+                max = min;
+            }
+            if (min == -1) {
+                min = 0;
+            }
+            if (*ps->p != '}' || (max != -1 && max < min)) {
+                ps->error = 1;
+                return -1;
+            }
+            ps->p++;
+        }
+        int r = nuevoNodo(ps, NODO_REPETIR, n, -1);
+        ps->nodos[r].min = min;
+        ps->nodos[r].max = max;
+        n = r;
+    }
+    return n;
+}
+
+// Función para analizar una secuencia de elementos
+int parseConcat(struct Parser *ps) {
+    int n = -1;
+    while (!ps->error && *ps->p != '\0' && *ps->p != '|' && *ps->p != ')') {
+        int r = parseRepetir(ps);
+        n = n == -1 ? r : nuevoNodo(ps, NODO_CONCAT, n, r);
+    }
+    return n == -1 ? nuevoNodo(ps, NODO_VACIO, -1, -1) : n;
+}
+
+// Función para analizar alternativas separadas por '|'
+int parseAlt(struct Parser *ps) {
+    int n = parseConcat(ps);
+    while (!ps->error && *ps->p == '|') {
+        ps->p++;
+        n = nuevoNodo(ps, NODO_ALT, n, parseConcat(ps));
+    }
+    return n;
+}
+
+// Función para crear un estado del NFA
+int nuevoEstadoNfa(struct Dfa *d, int tipo, int sig, int sig2, int clase) {
+    if (d->nnfa == NFA_MAX_ESTADOS) {
+        return -1;
+    }
+    d->nfa[d->nnfa].tipo = tipo;
+    d->nfa[d->nnfa].sig = sig;
+    d->nfa[d->nnfa].sig2 = sig2;
+    d->nfa[d->nnfa].clase = clase;
+    return d->nnfa++;
+}
+
+// Función para construir el NFA de un nodo (Thompson), enlazado con el estado sig.
+// Devuelve el estado inicial del fragmento o -1 si el NFA crece demasiado
+int compilarNodo(struct Dfa *d, struct Nodo *nodos, int n, int sig) {
+    if (sig < 0) {
+        return -1;
+    }
+    struct Nodo *nodo = &nodos[n];
+    switch (nodo->tipo) {
+    case NODO_VACIO:
+        return sig;
+    case NODO_CLASE:
+        return nuevoEstadoNfa(d, NFA_CLASE, sig, -1, nodo->clase);
+    case NODO_INICIO:
+        return nuevoEstadoNfa(d, NFA_INICIO, sig, -1, -1);
+    case NODO_FIN:
+        return nuevoEstadoNfa(d, NFA_FIN, sig, -1, -1);
+    case NODO_CONCAT:
+        return compilarNodo(d, nodos, nodo->a, compilarNodo(d, nodos, nodo->b, sig));
+    case NODO_ALT: {
+        int a = compilarNodo(d, nodos, nodo->a, sig);
+        int b = compilarNodo(d, nodos, nodo->b, sig);
+        return a < 0 || b < 0 ? -1 : nuevoEstadoNfa(d, NFA_SPLIT, a, b, -1);
+    }
+    default: { // NODO_REPETIR: x{m,n} se construye como m copias de x seguidas de n-m opcionales
+        int t = sig;
+        if (nodo->max == -1) {
+            int bucle = nuevoEstadoNfa(d, NFA_SPLIT, -1, sig, -1);
+            int cuerpo = compilarNodo(d, nodos, nodo->a, bucle);
+            if (bucle < 0 || cuerpo < 0) {
+                return -1;
+            }
+            d->nfa[bucle].sig = cuerpo;
+            t = bucle;
+        } else {
+            for (int i = nodo->min; i < nodo->max && t >= 0; i++) {
+                int cuerpo = compilarNodo(d, nodos, nodo->a, t);
+                t = cuerpo < 0 ? -1 : nuevoEstadoNfa(d, NFA_SPLIT, cuerpo, sig, -1);
+            }
+        }
+        for (int i = 0; i < nodo->min && t >= 0; i++) {
+            t = compilarNodo(d, nodos, nodo->a, t);
+        }
+        return t;
+    }
+    }
+}
+
+// Función para añadir a la lista el cierre vacío del estado s. Solo se guardan los estados
+// que importan para el DFA: los que consumen un byte, los '$' pendientes y el de aceptación
+void cierreNfa(struct Dfa *d, int s, int bol, int *lista, int *n) {
+    int tope = 0;
+    d->pila[tope++] = s;
+    while (tope > 0) {
+        int x = d->pila[--tope];
+        if (d->marca[x] == d->generacion) {
+            continue;
+        }
+        d->marca[x] = d->generacion;
+        struct NfaEstado *e = &d->nfa[x];
+        if (e->tipo == NFA_SPLIT) {
+            d->pila[tope++] = e->sig2;
+            d->pila[tope++] = e->sig;
+        } else if (e->tipo == NFA_INICIO) {
+            if (bol) {
+                d->pila[tope++] = e->sig;
+            }
+        } else {
+            lista[(*n)++] = x;
+        }
+    }
+}
+
+// Función para comprobar si un conjunto de estados reconoce al llegar al final de la línea,
+// pasando por los '$' pendientes
+int aceptaFinal(struct Dfa *d, const int *lista, int n, int bol) {
+    int tope = 0;
+    d->generacion++;
+    for (int i = 0; i < n; i++) {
+        if (d->nfa[lista[i]].tipo == NFA_ACEPTA) {
+            return 1;
+        }
+        if (d->nfa[lista[i]].tipo == NFA_FIN) {
+            d->pila[tope++] = d->nfa[lista[i]].sig;
+        }
+    }
+    while (tope > 0) {
+        int x = d->pila[--tope];
+        if (d->marca[x] == d->generacion) {
+            continue;
+        }
+        d->marca[x] = d->generacion;
+        struct NfaEstado *e = &d->nfa[x];
+        if (e->tipo == NFA_ACEPTA) {
+            return 1;
+        } else if (e->tipo == NFA_SPLIT) {
+            d->pila[tope++] = e->sig2;
+            d->pila[tope++] = e->sig;
+        } else if (e->tipo == NFA_FIN || (e->tipo == NFA_INICIO && bol)) {
+            d->pila[tope++] = e->sig;
+        }
+    }
+    return 0;
+}
+
+// Función de comparación de enteros para qsort
+int compararEnteros(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Función para vaciar la caché de estados del DFA cuando se llena
+void vaciarCacheDfa(struct Dfa *d) {
+    d->nestados = 0;
+    d->nconjuntos = 0;
+    d->inicial = -1;
+    d->vaciados++;
+    for (int i = 0; i < d->hash_cap; i++) {
+        d->hash[i] = -1;
+    }
+}
+
+// Función para obtener el estado del DFA de un conjunto ordenado de estados del NFA,
+// creándolo si no está en la caché. Devuelve el índice del estado
+int internarEstado(struct Dfa *d, const int *lista, int n) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < n; i++) {
+        h = (h ^ (uint32_t)lista[i]) * 16777619u;
+    }
+    int pos = h & (d->hash_cap - 1);
+    while (d->hash[pos] != -1) {
+        struct DfaEstado *e = &d->estados[d->hash[pos]];
+        if (e->n == n && memcmp(d->conjuntos + e->conjunto, lista, n * sizeof(int)) == 0) {
+            return d->hash[pos];
+        }
+        pos = (pos + 1) & (d->hash_cap - 1);
+    }
+
+    if (d->nestados == d->max_estados || d->nconjuntos + n > d->capconjuntos) {
+        vaciarCacheDfa(d);
+        return internarEstado(d, lista, n);
+    }
+    int s = d->nestados++;
+    struct DfaEstado *e = &d->estados[s];
+    e->conjunto = d->nconjuntos;
+    e->n = n;
+    memcpy(d->conjuntos + d->nconjuntos, lista, n * sizeof(int));
+    d->nconjuntos += n;
+    e->acepta = 0;
+    for (int i = 0; i < n; i++) {
+        if (d->nfa[lista[i]].tipo == NFA_ACEPTA) {
+            e->acepta = 1;
+        }
+    }
+    e->acepta_eol = aceptaFinal(d, lista, n, 0);
+    int *fila = d->trans + (size_t)s * d->nclases;
+    for (int k = 0; k < d->nclases; k++) {
+        fila[k] = DFA_DESCONOCIDO;
+    }
+    fila[d->clase['\n']] = DFA_SALTO;
+    d->hash[pos] = s;
+    return s;
+}
+
+// Función para obtener el estado de principio de línea
+int dfaInicial(struct Dfa *d) {
+    if (d->inicial == -1) {
+        int n = 0;
+        d->generacion++;
+        cierreNfa(d, d->inicio_nfa, 1, d->tmp, &n);
+        qsort(d->tmp, n, sizeof(int), compararEnteros);
+        d->inicial = internarEstado(d, d->tmp, n);
+    }
+    return d->inicial;
+}
+
+// Función para calcular la transición del estado s con un byte. A los estados alcanzados se
+// añade siempre el inicio de la expresión, que puede empezar en cualquier posición.
+// Devuelve la transición ya codificada
+int dfaTransicion(struct Dfa *d, int s, unsigned char c) {
+    int n = 0;
+    int vaciados = d->vaciados;
+    struct DfaEstado *e = &d->estados[s];
+    d->generacion++;
+    for (int i = 0; i < e->n; i++) {
+        struct NfaEstado *x = &d->nfa[d->conjuntos[e->conjunto + i]];
+        if (x->tipo == NFA_CLASE && (d->conjuntos_bytes[x->clase][c >> 3] & (1 << (c & 7)))) {
+            cierreNfa(d, x->sig, 0, d->tmp, &n);
+        }
+    }
+    cierreNfa(d, d->inicio_nfa, 0, d->tmp, &n);
+    qsort(d->tmp, n, sizeof(int), compararEnteros);
+    int t = internarEstado(d, d->tmp, n);
+    int codigo = d->estados[t].acepta ? -(t + 3) : t * d->nclases;
+    if (vaciados == d->vaciados) {
+        // Si se ha vaciado la caché, el estado s ya no existe
+        d->trans[(size_t)s * d->nclases + d->clase[c]] = codigo;
+    }
+    return codigo;
+}
+
+// Función para compilar expresiones regulares a un DFA perezoso que reconoce las líneas
+// que reconozca alguna de ellas. Devuelve NULL si alguna usa algo que este motor no soporta
+struct Dfa *compilarDfa(char **patrones, int npatrones) {
+    struct Parser ps;
+    memset(&ps, 0, sizeof(ps));
+    int raiz = -1;
+    for (int i = 0; i < npatrones && !ps.error; i++) {
+        ps.p = patrones[i];
+        int n = parseAlt(&ps);
+        if (*ps.p != '\0') {
+            ps.error = 1;
+        }
+        raiz = raiz == -1 ? n : nuevoNodo(&ps, NODO_ALT, raiz, n);
+    }
+    if (ps.error) {
+        free(ps.nodos);
+        free(ps.conj);
+        return NULL;
+    }
+
+    struct Dfa *d = calloc(1, sizeof(struct Dfa));
+    if (d == NULL) {
+        fprintf(stderr, "ERROR: malloc()\n");
+        exit(EXIT_FAILURE);
+    }
+    d->nfa = reservar(NULL, NFA_MAX_ESTADOS * sizeof(struct NfaEstado));
+    int acepta = nuevoEstadoNfa(d, NFA_ACEPTA, -1, -1, -1);
+    d->inicio_nfa = compilarNodo(d, ps.nodos, raiz, acepta);
+    free(ps.nodos);
+    d->conjuntos_bytes = ps.conj;
+    if (d->inicio_nfa < 0) {
+        liberarDfa(d);
+        return NULL;
+    }
+
+    // Clases de equivalencia: bytes que pertenecen a los mismos conjuntos. El '\n' va aparte
+    int nuevo[2][256];
+    d->nclases = 1;
+    memset(d->clase, 0, sizeof(d->clase));
+    for (int k = -1; k < ps.nconj; k++) {
+        int nclases = 0;
+        for (int i = 0; i < 2; i++) {
+            for (int j = 0; j < 256; j++) {
+                nuevo[i][j] = -1;
+            }
+        }
+        for (int c = 0; c < 256; c++) {
+            int dentro = k == -1 ? c == '\n' : (ps.conj[k][c >> 3] >> (c & 7)) & 1;
+            if (nuevo[dentro][d->clase[c]] == -1) {
+                nuevo[dentro][d->clase[c]] = nclases++;
+            }
+            d->clase[c] = nuevo[dentro][d->clase[c]];
+        }
+        d->nclases = nclases;
+    }
+
+    d->pila = reservar(NULL, (3 * d->nnfa + 2) * sizeof(int));
+    d->marca = calloc(d->nnfa, sizeof(int));
+    d->tmp = reservar(NULL, d->nnfa * sizeof(int));
+    d->max_estados = DFA_MEMORIA / (d->nclases * sizeof(int) + sizeof(struct DfaEstado));
+    if (d->max_estados < 16) {
+        d->max_estados = 16;
+    }
+    d->capconjuntos = d->max_estados * 8 > d->nnfa ? d->max_estados * 8 : d->nnfa;
+    d->hash_cap = 1;
+    while (d->hash_cap < 2 * d->max_estados) {
+        d->hash_cap *= 2;
+    }
+    d->estados = reservar(NULL, d->max_estados * sizeof(struct DfaEstado));
+    d->trans = reservar(NULL, (size_t)d->max_estados * d->nclases * sizeof(int));
+    d->conjuntos = reservar(NULL, d->capconjuntos * sizeof(int));
+    d->hash = reservar(NULL, d->hash_cap * sizeof(int));
+    if (d->marca == NULL) {
+        fprintf(stderr, "ERROR: malloc()\n");
+        exit(EXIT_FAILURE);
+    }
+    vaciarCacheDfa(d);
+    d->vaciados = 0;
+
+    // Casos de la línea vacía y de expresiones que reconocen cualquier línea (como "a*")
+    int n = 0;
+    d->generacion++;
+    cierreNfa(d, d->inicio_nfa, 1, d->tmp, &n);
+    d->vacia = aceptaFinal(d, d->tmp, n, 1);
+    d->todas = d->estados[dfaInicial(d)].acepta;
+    return d;
+}
+
+// Función para liberar un DFA
+void liberarDfa(struct Dfa *d) {
+    if (d == NULL) {
+        return;
+    }
+    free(d->nfa);
+    free(d->conjuntos_bytes);
+    free(d->pila);
+    free(d->marca);
+    free(d->tmp);
+    free(d->estados);
+    free(d->trans);
+    free(d->conjuntos);
+    free(d->hash);
+    free(d);
+}
+
+// Función para encontrar con el DFA la siguiente línea reconocida en [p, end), recorriendo
+// el buffer de una sola pasada. Devuelve 1 y los límites de la línea en *ls y *le
+int dfaSiguiente(struct Dfa *d, const char *p, const char *end, const char **ls, const char **le) {
+    const char *line_start = p;
+    if (d->todas) {
+        *ls = p;
+        *le = p < end ? buscarSalto(p, end) : NULL;
+        if (*le == NULL) {
+            *le = end;
+        }
+        return p < end;
+    }
+    // Las tablas no se mueven al vaciar la caché, así que se pueden tener en variables locales
+    const int *trans = d->trans;
+    const uint8_t *clase = d->clase;
+    int nclases = d->nclases;
+    int fila = dfaInicial(d) * nclases; // Fila del estado actual
+    while (p < end) {
+        int sig = trans[fila + clase[(unsigned char)*p]];
+        if (sig >= 0) {
+            fila = sig;
+            p++;
+            continue;
+        }
+        if (sig == DFA_DESCONOCIDO) {
+            sig = dfaTransicion(d, fila / nclases, *p);
+            if (sig >= 0) {
+                fila = sig;
+                p++;
+                continue;
+            }
+        }
+        if (sig == DFA_SALTO) {
+            // Fin de línea: puede reconocer todavía gracias a un '$'
+            if (p == line_start ? d->vacia : d->estados[fila / nclases].acepta_eol) {
+                *ls = line_start;
+                *le = p;
+                return 1;
+            }
+            line_start = ++p;
+            fila = dfaInicial(d) * nclases;
+        } else {
+            // Estado de aceptación: el resto de la línea ya no importa
+            *ls = line_start;
+            *le = buscarSalto(p, end);
+            if (*le == NULL) {
+                *le = end;
+            }
+            return 1;
+        }
+    }
+    // Última línea sin '\n'
+    if (line_start < end && d->estados[fila / nclases].acepta_eol) {
+        *ls = line_start;
+        *le = end;
+        return 1;
+    }
+    return 0;
+}
+
+// Función para comprobar con el DFA una sola línea [inicio, fin)
+int dfaLineaCoincide(struct Dfa *d, const char *inicio, const char *fin) {
+    const char *ls, *le;
+    if (inicio == fin) {
+        return d->vacia || d->todas;
+    }
+    return dfaSiguiente(d, inicio, fin, &ls, &le);
+}
+
+// Función para saltar una expresión entre corchetes; devuelve el carácter siguiente al ']'
+const char *saltarCorchetes(const char *p) {
+    p++; // '['
+    if (*p == '^') {
+        p++;
+    }
+    if (*p == ']') {
+        p++; // Un ']' al principio es un carácter más
+    }
+    while (*p != '\0' && *p != ']') {
+        if (*p == '[' && (p[1] == ':' || p[1] == '=' || p[1] == '.')) {
+            // Clases [:alpha:], equivalencias [=a=] y símbolos [.-.]
+            char cierre = p[1];
+            p += 2;
+            while (*p != '\0' && !(*p == cierre && p[1] == ']')) {
+                p++;
+            }
+            if (*p != '\0') {
+                p += 2;
+            }
+        } else {
+            p++;
+        }
+    }
+    return *p == ']' ? p + 1 : p;
+}
+
+// Función para extraer el literal más largo que tiene que aparecer en toda línea reconocida
+// por la expresión regular. Devuelve su longitud (0 si no hay ninguno) y marca en exacto si
+// la expresión entera es ese literal
+size_t extraerLiteral(const char *patron, char *literal, size_t max, int *exacto) {
+    char actual[MAX_LITERAL];
+    size_t actual_len = 0, mejor_len = 0;
+    int cortes = 0; // Elementos de la expresión que no son literales
+    const char *p = patron;
+
+    while (*p != '\0') {
+        int es_literal = 0;
+        char c = 0;
+        if (*p == '\\' && p[1] != '\0' && strchr(".[]()*+?{}|^$\\", p[1]) != NULL) {
+            // Un metacarácter escapado es un literal
+            c = p[1];
+            es_literal = 1;
+            p += 2;
+        } else if (*p == '|') {
+            // Con alternativas en el nivel superior ningún literal es obligatorio
+            *exacto = 0;
+            return 0;
+        } else if (*p == '*' || *p == '?' || *p == '{') {
+            // El elemento anterior es opcional o se repite: no forma parte del literal
+            if (actual_len > 0) {
+                actual_len--;
+            }
+            if (*p == '{') {
+                // Solo se aceptan intervalos bien formados {m}, {m,} o {m,n}
+                p++;
+                while (*p >= '0' && *p <= '9') {
+                    p++;
+                }
+                if (*p == ',') {
+                    p++;
+                }
+                while (*p >= '0' && *p <= '9') {
+                    p++;
+                }
+                if (*p != '}') {
+                    *exacto = 0;
+                    return 0;
+                }
+            }
+            p++;
+        } else if (*p == '+') {
+            // El elemento anterior aparece al menos una vez, pero lo siguiente ya no va pegado.
+            // Si detrás viene otro cuantificador (+?, +* o +{0,n}) puede no aparecer, así que
+            // tampoco forma parte del literal
+            if ((p[1] == '?' || p[1] == '*' || p[1] == '{') && actual_len > 0) {
+                actual_len--;
+            }
+            p++;
+        } else if (*p == '[') {
+            p = saltarCorchetes(p);
+        } else if (*p == '(') {
+            // Se salta el grupo completo, que puede tener alternativas dentro
+            int nivel = 0;
+            do {
+                if (*p == '\\' && p[1] != '\0') {
+                    p++;
+                } else if (*p == '[') {
+                    p = saltarCorchetes(p) - 1;
+                } else if (*p == '(') {
+                    nivel++;
+                } else if (*p == ')') {
+                    nivel--;
+                }
+                p++;
+            } while (*p != '\0' && nivel > 0);
+        } else if (*p == '\\' || *p == '.' || *p == '^' || *p == '$' || *p == ')' || *p == '\n') {
+            // Referencias hacia atrás, extensiones GNU como \w, anclas y comodines
+            p += (*p == '\\' && p[1] != '\0') ? 2 : 1;
+        } else {
+            c = *p++;
+            es_literal = 1;
+        }
+
+        if (es_literal && actual_len < sizeof(actual)) {
+            actual[actual_len++] = c;
+        } else {
+            if (!es_literal) {
+                cortes = 1;
+            }
+            if (actual_len > mejor_len && actual_len <= max) {
+                memcpy(literal, actual, actual_len);
+                mejor_len = actual_len;
+            }
+            actual_len = 0;
+            if (es_literal) {
+                actual[actual_len++] = c; // El literal era demasiado largo: empieza otro
+                cortes = 1;
+            }
+        }
+    }
+    if (actual_len > mejor_len && actual_len <= max) {
+        memcpy(literal, actual, actual_len);
+        mejor_len = actual_len;
+    }
+    *exacto = !cortes && mejor_len > 0;
+    return mejor_len;
+}
+
+// Función para construir el autómata de Aho-Corasick de un conjunto de literales
+struct AhoCorasick *construirAho(char **literales, int n) {
+    struct AhoCorasick *ac = calloc(1, sizeof(struct AhoCorasick));
+    if (ac == NULL) {
+        fprintf(stderr, "ERROR: malloc()\n");
+        exit(EXIT_FAILURE);
+    }
+    // Cada byte que aparece en algún literal tiene su clase; el resto comparten la 0
+    size_t total = 1;
+    ac->nclases = 1;
+    for (int i = 0; i < n; i++) {
+        for (const unsigned char *c = (const unsigned char *)literales[i]; *c != '\0'; c++) {
+            if (ac->clase[*c] == 0) {
+                ac->clase[*c] = ac->nclases++;
+            }
+        }
+        total += strlen(literales[i]);
+    }
+
+    // Trie con una fila de transiciones por estado (-1 si no hay arista)
+    int nclases = ac->nclases;
+    int *trans = reservar(NULL, total * nclases * sizeof(int));
+    int *fallo = reservar(NULL, total * sizeof(int));
+    uint8_t *salida = calloc(total, 1);
+    if (salida == NULL) {
+        fprintf(stderr, "ERROR: malloc()\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int k = 0; k < nclases; k++) {
+        trans[k] = -1;
+    }
+    int nestados = 1;
+    for (int i = 0; i < n; i++) {
+        int s = 0;
+        for (const unsigned char *c = (const unsigned char *)literales[i]; *c != '\0'; c++) {
+            int *t = &trans[(size_t)s * nclases + ac->clase[*c]];
+            if (*t == -1) {
+                *t = nestados;
+                for (int k = 0; k < nclases; k++) {
+                    trans[(size_t)nestados * nclases + k] = -1;
+                }
+                nestados++;
+            }
+            s = *t;
+        }
+        salida[s] = 1;
+    }
+
+    // Recorrido en anchura: se calculan los fallos y se completan las transiciones que
+    // faltan con las del estado de fallo, que al estar menos profundo ya está completo
+    int *cola = reservar(NULL, nestados * sizeof(int));
+    int cabeza = 0, cola_len = 0;
+    fallo[0] = 0;
+    for (int k = 0; k < nclases; k++) {
+        if (trans[k] == -1) {
+            trans[k] = 0;
+        } else {
+            fallo[trans[k]] = 0;
+            cola[cola_len++] = trans[k];
+        }
+    }
+    while (cabeza < cola_len) {
+        int u = cola[cabeza++];
+        for (int k = 0; k < nclases; k++) {
+            int *t = &trans[(size_t)u * nclases + k];
+            int f = trans[(size_t)fallo[u] * nclases + k];
+            if (*t == -1) {
+                *t = f;
+            } else {
+                fallo[*t] = f;
+                salida[*t] |= salida[f];
+                cola[cola_len++] = *t;
+            }
+        }
+    }
+
+    // Las transiciones guardan la fila del destino y, en negativo, si allí termina un literal
+    for (size_t i = 0; i < (size_t)nestados * nclases; i++) {
+        int fila = trans[i] * nclases;
+        trans[i] = salida[trans[i]] ? ~fila : fila;
+    }
+    ac->trans = reservar(trans, (size_t)nestados * nclases * sizeof(int));
+    ac->nestados = nestados;
+    free(fallo);
+    free(salida);
+    free(cola);
+    return ac;
+}
+
+// Función para liberar el autómata de Aho-Corasick
+void liberarAho(struct AhoCorasick *ac) {
+    if (ac != NULL) {
+        free(ac->trans);
+        free(ac);
+    }
+}
+
+// Función para encontrar la siguiente línea de [p, end) que contiene alguno de los literales.
+// p tiene que ser un principio de línea
+int ahoSiguiente(struct AhoCorasick *ac, const char *p, const char *end, const char **ls, const char **le) {
+    const int *trans = ac->trans;
+    const uint8_t *clase = ac->clase;
+    int fila = 0;
+    // Los literales no tienen '\n', así que con él se vuelve siempre a la raíz
+    for (const char *q = p; q < end; q++) {
+        fila = trans[fila + clase[(unsigned char)*q]];
+        if (fila < 0) {
+            *ls = memrchr(p, '\n', q - p);
+            *ls = *ls == NULL ? p : *ls + 1;
+            *le = buscarSalto(q, end);
+            if (*le == NULL) {
+                *le = end;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Función para compilar las expresiones regulares del buscador con regcomp()
+void compilarRegex(struct Buscador *b) {
+    b->regex = reservar(NULL, (b->nregex > 0 ? b->nregex : 1) * sizeof(regex_t));
+    for (int i = 0; i < b->nregex; i++) {
+        // Comprobar si la expresión regular está bien construida
+        if (regcomp(&b->regex[i], b->patrones[i], REG_EXTENDED | REG_NEWLINE) != 0) {
+            fprintf(stderr, "ERROR: REGEX mal construida\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Función para preparar el buscador a partir de los patrones de la línea de comandos
+void prepararBuscador(struct Buscador *b, struct Opciones *op) {
+    memset(b, 0, sizeof(*b));
+    b->patrones = reservar(NULL, op->npatrones * sizeof(char *));
+    char **literales = reservar(NULL, op->npatrones * sizeof(char *));
+    int nliterales = 0;
+    for (int i = 0; i < op->npatrones; i++) {
+        // Con varios patrones, los que son literales puros van al autómata
+        char literal[MAX_LITERAL];
+        int exacto = 0;
+        size_t len = extraerLiteral(op->patrones[i], literal, sizeof(literal) - 1, &exacto);
+        if (op->npatrones > 1 && exacto) {
+            literales[nliterales] = reservar(NULL, len + 1);
+            memcpy(literales[nliterales], literal, len);
+            literales[nliterales++][len] = '\0';
+        } else {
+            b->patrones[b->nregex++] = op->patrones[i];
+        }
+    }
+    compilarRegex(b);
+
+    if (b->nregex == 1 && nliterales == 0) {
+        b->literal_len = extraerLiteral(b->patrones[0], b->literal, sizeof(b->literal), &b->exacto);
+    }
+    if (b->nregex > 0 && op->motor != MOTOR_POSIX) {
+        b->dfa = compilarDfa(b->patrones, b->nregex);
+        if (b->dfa == NULL && op->motor == MOTOR_DFA) {
+            fprintf(stderr, "ERROR: el motor dfa no admite esta REGEX\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (nliterales > 0) {
+        b->ac = construirAho(literales, nliterales);
+    }
+    for (int i = 0; i < nliterales; i++) {
+        free(literales[i]);
+    }
+    free(literales);
+}
+
+// Función para copiar el buscador para otro hilo: el autómata de literales es de solo
+// lectura y se comparte, pero regexec() y la caché del DFA necesitan una copia propia
+void clonarBuscador(struct Buscador *copia, const struct Buscador *b) {
+    *copia = *b;
+    compilarRegex(copia);
+    if (b->dfa != NULL) {
+        copia->dfa = compilarDfa(b->patrones, b->nregex);
+    }
+}
+
+// Función para liberar la copia de un buscador
+void liberarClon(struct Buscador *b) {
+    for (int i = 0; i < b->nregex; i++) {
+        regfree(&b->regex[i]);
+    }
+    free(b->regex);
+    liberarDfa(b->dfa);
+}
+
+// Función para encontrar la siguiente línea reconocida por las expresiones regulares
+int siguienteRegex(struct Buscador *b, const char *p, const char *end, const char **ls, const char **le) {
+    while (p < end) {
+        const char *line_start, *line_end;
+        if (b->literal_len == 0 && b->dfa != NULL) {
+            // Sin literal, el DFA recorre el buffer entero de una pasada
+            return dfaSiguiente(b->dfa, p, end, ls, le);
+        }
+        if (b->literal_len > 0) {
+            // Solo se comprueban las líneas que contienen el literal obligatorio
+            const char *hit = buscarLiteral(p, end, b->literal, b->literal_len);
+            if (hit == NULL) {
+                return 0;
+            }
+            line_start = memrchr(p, '\n', hit - p);
+            line_start = line_start == NULL ? p : line_start + 1;
+            line_end = buscarSalto(hit + b->literal_len, end);
+        } else {
+            line_start = p;
+            line_end = buscarSalto(p, end);
+        }
+        if (line_end == NULL) {
+            line_end = end;
+        }
+        int match;
+        if (b->exacto) {
+            match = 1;
+        } else if (b->dfa != NULL) {
+            match = dfaLineaCoincide(b->dfa, line_start, line_end);
+        } else {
+            match = lineaCoincide(b->regex, b->nregex, line_start, line_end);
+        }
+        if (match) {
+            *ls = line_start;
+            *le = line_end;
+            return 1;
+        }
+        p = line_end + 1;
+    }
+    return 0;
+}
+
+// Función para encontrar la siguiente línea reconocida en [p, end). Devuelve 1 y deja en
+// *ls el principio de la línea y en *le su '\n' (o end si es la última y no lo tiene)
+int siguienteCoincidencia(struct Buscador *b, const char *p, const char *end, const char **ls, const char **le) {
+    if (b->ac == NULL) {
+        return siguienteRegex(b, p, end, ls, le);
+    }
+    // La siguiente línea con un literal se guarda hasta que se pasa de ella, para no
+    // recorrer otra vez lo mismo cuando antes hay líneas reconocidas por las expresiones
+    if (!b->ac_valido || (b->ac_ls != NULL && b->ac_ls < p)) {
+        b->ac_valido = 1;
+        if (!ahoSiguiente(b->ac, p, end, &b->ac_ls, &b->ac_le)) {
+            b->ac_ls = NULL;
+        }
+    }
+    // Las expresiones solo se comprueban en las líneas que el autómata no ha decidido
+    const char *hasta = b->ac_ls != NULL ? b->ac_ls : end;
+    if (b->nregex > 0 && p < hasta && siguienteRegex(b, p, hasta, ls, le)) {
+        return 1;
+    }
+    if (b->ac_ls == NULL) {
+        return 0;
+    }
+    *ls = b->ac_ls;
+    *le = b->ac_le;
+    return 1;
+}
+
+// Función para contar las líneas de [p, end), incluida una última sin '\n'
+long long contarLineas(const char *p, const char *end) {
+    if (p >= end) {
+        return 0;
+    }
+    return contarSaltos(p, end) + (end[-1] != '\n');
+}
+
+// Función para contar las líneas aceptadas de [inicio, end) para -c, sin tocar el buffer ni
+// preparar salida: solo se salta de coincidencia en coincidencia. En modo inverso se
+// cuentan las coincidencias y se restan del total de líneas
+long long contarAceptadas(struct Buscador *b, int regex_flag, const char *inicio, const char *end) {
+    long long coincidencias = 0;
+    const char *p = inicio;
+    const char *ls, *le;
+    while (p < end && siguienteCoincidencia(b, p, end, &ls, &le)) {
+        coincidencias++;
+        p = le < end ? le + 1 : end;
+    }
+    return regex_flag == -1 ? contarLineas(inicio, end) - coincidencias : coincidencias;
+}
+
+// Función para contar las líneas de [p, end) por longitudes para --stats
+void estadisticasLineas(const char *p, const char *end) {
+    uint64_t cubetas[NUM_CUBETAS] = {0};
+    uint64_t lineas = 0;
+    while (p < end) {
+        const char *salto = buscarSalto(p, end);
+        const char *fin = salto != NULL ? salto : end;
+        size_t len = fin - p;
+        cubetas[len == 0 ? 0 : len >= (1ULL << 31) ? NUM_CUBETAS - 1 : 64 - __builtin_clzll(len)]++;
+        lineas++;
+        p = fin + 1;
+    }
+    sumarStats(&estadisticas.lineas, lineas);
+    for (int i = 0; i < NUM_CUBETAS; i++) {
+        if (cubetas[i] > 0) {
+            sumarStats(&estadisticas.cubetas[i], cubetas[i]);
+        }
+    }
+}
+
+// Función para preparar el contexto de -A/-B/-C
+void iniciarContexto(struct Contexto *ctx, int antes, int despues) {
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->antes = antes;
+    ctx->despues = despues;
+    ctx->anillo = reservar(NULL, (antes > 0 ? antes : 1) * sizeof(struct LineaPrevia));
+}
+
+// Función para empezar otra entrada con el mismo contexto
+void reiniciarContexto(struct Contexto *ctx) {
+    ctx->pendientes = 0;
+    ctx->posicion = 0;
+    ctx->escrito = 0;
+    ctx->nprevias = 0;
+}
+
+// Función para saber cuántos bytes antes del bloque siguiente ocupan las líneas del anillo,
+// que el buffer de lectura tiene que conservar
+size_t contextoRetenido(struct Contexto *ctx) {
+    if (ctx == NULL || ctx->nprevias == 0) {
+        return 0;
+    }
+    return ctx->posicion - ctx->anillo[ctx->primera].posicion;
+}
+
+// Función para escribir líneas completas [inicio, fin) del bloque que empieza en base,
+// con un separador si no van justo detrás de lo último escrito
+void escribirContexto(struct Contexto *ctx, struct Salida *salida, const char *base, const char *inicio, const char *fin, int aceptadas) {
+    long long posicion = ctx->posicion + (inicio - base);
+    if (ctx->escrito && posicion != ctx->fin_escrito) {
+        anadirTrozo(salida, "--\n", "--\n" + 3);
+    }
+    if (aceptadas) {
+        anadirSalida(salida, inicio, fin);
+    } else {
+        anadirContexto(salida, inicio, fin);
+    }
+    ctx->escrito = 1;
+    ctx->fin_escrito = posicion + (fin - inicio);
+}
+
+// Función para escribir las líneas de contexto que faltan tras la última aceptada,
+// sin pasar de hasta. Devuelve dónde se ha quedado
+const char *contextoDespues(struct Contexto *ctx, struct Salida *salida, const char *base, const char *q, const char *hasta) {
+    const char *inicio = q;
+    while (ctx->pendientes > 0 && q < hasta) {
+        const char *salto = buscarSalto(q, hasta);
+        q = salto != NULL ? salto + 1 : hasta;
+        ctx->pendientes--;
+    }
+    if (q > inicio) {
+        escribirContexto(ctx, salida, base, inicio, q, 0);
+    }
+    return q;
+}
+
+// Función para escribir las líneas de contexto anteriores a un bloque aceptado que empieza
+// en bs. Las que no estén en [q, bs) salen del anillo si q es el principio del bloque
+void contextoAntes(struct Contexto *ctx, struct Salida *salida, const char *base, const char *q, const char *bs) {
+    const char *r = bs;
+    int n = 0;
+    while (n < ctx->antes && r > q) {
+        const char *salto = r - 1 > q ? memrchr(q, '\n', r - 1 - q) : NULL;
+        r = salto != NULL ? salto + 1 : q;
+        n++;
+    }
+    if (n < ctx->antes && q == base) {
+        // Las del anillo son las inmediatamente anteriores al bloque
+        int usar = ctx->antes - n < ctx->nprevias ? ctx->antes - n : ctx->nprevias;
+        for (int i = ctx->nprevias - usar; i < ctx->nprevias; i++) {
+            struct LineaPrevia *l = &ctx->anillo[(ctx->primera + i) % ctx->antes];
+            const char *inicio = base - (ctx->posicion - l->posicion);
+            escribirContexto(ctx, salida, base, inicio, inicio + l->len, 0);
+        }
+    }
+    if (r < bs) {
+        escribirContexto(ctx, salida, base, r, bs, 0);
+    }
+    ctx->nprevias = 0;
+}
+
+// Función para guardar en el anillo las últimas líneas sin escribir de [q, end) al acabar
+// un bloque. Si no se ha escrito nada del bloque, se conservan también las anteriores
+void guardarPrevias(struct Contexto *ctx, const char *base, const char *q, const char *end) {
+    if (q > base) {
+        ctx->nprevias = 0;
+    }
+    if (ctx->antes == 0) {
+        return;
+    }
+    // Principio de las últimas líneas, como mucho antes
+    const char *r = end;
+    int n = 0;
+    while (n < ctx->antes && r > q) {
+        const char *salto = r - 1 > q ? memrchr(q, '\n', r - 1 - q) : NULL;
+        r = salto != NULL ? salto + 1 : q;
+        n++;
+    }
+    while (r < end) {
+        const char *salto = buscarSalto(r, end);
+        const char *fin = salto != NULL ? salto + 1 : end;
+        if (ctx->nprevias == ctx->antes) {
+            ctx->primera = (ctx->primera + 1) % ctx->antes;
+            ctx->nprevias--;
+        }
+        struct LineaPrevia *l = &ctx->anillo[(ctx->primera + ctx->nprevias) % ctx->antes];
+        l->posicion = ctx->posicion + (r - base);
+        l->len = fin - r;
+        ctx->nprevias++;
+        r = fin;
+    }
+}
+
+// Función para recorrer las líneas de [inicio, end) escribiendo también las de contexto.
+// Cada llamada tiene que continuar donde acabó la anterior. Devuelve las líneas aceptadas
+long long recorrerConContexto(struct Buscador *b, int regex_flag, const char *inicio, const char *end, struct Salida *salida, struct Contexto *ctx) {
+    long long cuenta = 0;
+    const char *p = inicio; // Por dónde va la búsqueda
+    const char *q = inicio; // Principio de lo que no se ha escrito
+    const char *ls, *le;
+    while (p < end) {
+        // Siguiente bloque de líneas aceptadas [bs, be)
+        int hay = siguienteCoincidencia(b, p, end, &ls, &le);
+        const char *fin = hay ? (le < end ? le + 1 : end) : end;
+        const char *bs, *be;
+        if (regex_flag == -1) {
+            bs = p;
+            be = hay ? ls : end;
+        } else {
+            if (!hay) {
+                break;
+            }
+            bs = ls;
+            be = fin;
+        }
+        p = fin;
+        if (bs < be) {
+            cuenta += regex_flag == -1 ? contarLineas(bs, be) : 1;
+            q = contextoDespues(ctx, salida, inicio, q, bs);
+            contextoAntes(ctx, salida, inicio, q, bs);
+            escribirContexto(ctx, salida, inicio, bs, be, 1);
+            ctx->pendientes = ctx->despues;
+            q = be;
+        }
+        if (!hay) {
+            break;
+        }
+    }
+    q = contextoDespues(ctx, salida, inicio, q, end);
+    guardarPrevias(ctx, inicio, q, end);
+    ctx->posicion += end - inicio;
+    return cuenta;
+}
+
+// Función para recorrer las líneas de [inicio, end), pasando a la salida cada bloque de líneas
+// aceptadas. Devuelve el número de líneas aceptadas
+long long recorrerLineas(struct Buscador *b, int regex_flag, int count_flag, const char *inicio, const char *end, struct Salida *salida, struct Contexto *ctx) {
+    long long cuenta = 0;
+    const char *p = inicio;
+    const char *ls, *le;
+    uint64_t t0 = 0, escritura0 = ns_escritura_hilo;
+    if (estadisticas.activas) {
+        t0 = relojNs();
+    }
+    b->ac_valido = 0; // Búsqueda nueva: lo guardado del autómata era de otro buffer
+    if (count_flag) {
+        cuenta = contarAceptadas(b, regex_flag, inicio, end);
+        p = end;
+    } else if (ctx != NULL) {
+        cuenta = recorrerConContexto(b, regex_flag, inicio, end, salida, ctx);
+        p = end;
+    }
+    while (p < end && siguienteCoincidencia(b, p, end, &ls, &le)) {
+        const char *fin = le < end ? le + 1 : end;
+        if (regex_flag == -1) {
+            // En modo inverso se aceptan de golpe todas las líneas hasta la coincidencia
+            if (ls > p) {
+                cuenta += contarLineas(p, ls);
+                anadirSalida(salida, p, ls);
+            }
+        } else {
+            cuenta++;
+            anadirSalida(salida, ls, fin);
+        }
+        p = fin;
+    }
+    if (regex_flag == -1 && p < end && ctx == NULL) {
+        cuenta += contarLineas(p, end);
+        anadirSalida(salida, p, end);
+    }
+    if (estadisticas.activas) {
+        // Las escrituras que se hayan hecho al llenarse la salida ya están en su etapa
+        uint64_t ns = relojNs() - t0 - (ns_escritura_hilo - escritura0);
+        sumarStats(&estadisticas.ns[ETAPA_BUSQUEDA], ns);
+        sumarStats(&estadisticas.bytes, end - inicio);
+        sumarStats(&estadisticas.aceptadas, cuenta);
+        estadisticasLineas(inicio, end);
+    }
+    return cuenta;
+}
+
+// Función para comprobar que una línea incompleta no pasa de la longitud máxima
+void comprobarLongitud(size_t len, long long maxlinea) {
+    if (maxlinea > 0 && len > (unsigned long long)maxlinea) {
+        fprintf(stderr, "ERROR: Línea demasiado larga\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Función para procesar la entrada con read(). Las líneas completas se procesan en el propio
+// buffer de lectura; la línea incompleta del final se queda donde está y solo se mueve al
+// principio cuando no cabe otra lectura. Si ocupa todo el buffer, este dobla su tamaño
+void minigrepLectura(struct Buscador *b, int regex_flag, int count_flag, int bufsize, long long maxlinea, struct Contexto *ctx) {
+    size_t capacidad = 4 * (size_t)bufsize > MIN_LECTURA ? 4 * (size_t)bufsize : MIN_LECTURA;
+    char *buffer = reservar(NULL, capacidad);
+    size_t len = 0;       // Bytes leídos en el buffer
+    size_t pendiente = 0; // Principio de la línea incompleta
+    long long match_count = 0;
+    ssize_t bytes_read;
+    struct Salida salida;
+    iniciarSalida(&salida, STDOUT_FILENO, bufsize);
+
+    while (1) {
+        if (capacidad - len < (size_t)bufsize) {
+            // La salida apunta al buffer, que se va a mover. Se conservan la línea
+            // incompleta y las anteriores que aún pueden hacer falta como contexto
+            vaciarSalida(&salida);
+            size_t desde = pendiente - contextoRetenido(ctx);
+            if (desde > 0) {
+                uint64_t t0 = estadisticas.activas ? relojNs() : 0;
+                memmove(buffer, buffer + desde, len - desde);
+                if (estadisticas.activas) {
+                    medirEtapa(ETAPA_COPIA, t0);
+                    sumarStats(&estadisticas.arrastres, 1);
+                    sumarStats(&estadisticas.bytes_arrastrados, len - desde);
+                }
+                len -= desde;
+                pendiente -= desde;
+            }
+            if (capacidad - len < (size_t)bufsize) {
+                capacidad *= 2;
+                buffer = reservar(buffer, capacidad);
+            }
+        }
+
+        bytes_read = leerEntrada(buffer + len, tamLectura(bufsize, capacidad - len));
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            break;
+        }
+        // Solo hace falta buscar el último '\n' entre los bytes nuevos
+        char *ultimo = memrchr(buffer + len, '\n', bytes_read);
+        len += bytes_read;
+        if (ultimo != NULL) {
+            match_count += recorrerLineas(b, regex_flag, count_flag, buffer + pendiente, ultimo + 1, &salida, ctx);
+            pendiente = ultimo + 1 - buffer;
+        }
+        comprobarLongitud(len - pendiente, maxlinea);
+    }
+
+    // Comprobar si hubo un error de lectura
+    if (bytes_read == -1) {
+        fprintf(stderr, "ERROR: read()\n");
+        free(buffer);
+        exit(EXIT_FAILURE);
+    }
+
+    // Comprobar el caso de que quede una línea por procesar sin \n al final
+    if (pendiente < len) {
+        match_count += recorrerLineas(b, regex_flag, count_flag, buffer + pendiente, buffer + len, &salida, ctx);
+    }
+    vaciarSalida(&salida);
+    if (count_flag) {
+        printf("%lld\n", match_count);
+    }
+
+    // Liberar la memoria de los buffers
+    free(buffer);
+    free(salida.iov);
+}
+
+// Función para procesar la entrada proyectada en memoria, comprobando las líneas en su sitio
+void minigrepMmap(struct Buscador *b, int regex_flag, int count_flag, int bufsize, off_t size, struct Contexto *ctx) {
+    long long match_count = 0;
+    // La proyección tiene que empezar en un múltiplo de página, así que se proyecta
+    // desde el principio y se respeta la posición actual de la entrada
+    off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+    if (offset < 0 || offset > size) {
+        offset = 0;
+    }
+
+    if (size > offset) {
+        char *map = proyectar(STDIN_FILENO, size);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "ERROR: mmap()\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // Las líneas aceptadas se escriben directamente desde la proyección, en bloques de BUFSIZE
+        struct Salida salida;
+        iniciarSalida(&salida, STDOUT_FILENO, bufsize);
+        match_count = recorrerLineas(b, regex_flag, count_flag, map + offset, map + size, &salida, ctx);
+        vaciarSalida(&salida);
+        free(salida.iov);
+        munmap(map, size);
+    }
+
+    if (count_flag) {
+        printf("%lld\n", match_count);
+    }
+}
+
+// Estados de un trozo de la búsqueda en paralelo
+#define TROZO_LIBRE 0   // Su salida ya se ha escrito y se puede volver a llenar
+#define TROZO_LLENO 1   // Tiene líneas pendientes de procesar
+#define TROZO_HECHO 2   // Procesado, con la salida esperando su turno
+
+// Trozo de la entrada formado por líneas completas
+struct Trozo {
+    const char *datos;  // Primera línea del trozo
+    size_t len;         // Bytes de líneas completas (la última puede no tener '\n')
+    char *propio;       // Buffer para entradas que no se pueden proyectar (NULL si no hace falta)
+    size_t capacidad;   // Tamaño reservado de propio
+    struct Salida salida; // Líneas aceptadas, apuntando a los datos del trozo
+    long long cuenta;   // Líneas aceptadas del trozo
+    int estado;
+};
+
+// Estado compartido entre el hilo principal y los hilos de búsqueda
+struct Pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t hay_trabajo;  // Avisa a los hilos de que hay trozos llenos
+    pthread_cond_t hecho;        // Avisa al hilo principal de que un trozo ha terminado
+    struct Trozo *trozos;        // Cola circular acotada de trozos
+    int ntrozos;
+    long llenados;               // Trozos entregados por el hilo principal
+    long asignados;              // Trozos cogidos por los hilos
+    long escritos;               // Trozos cuya salida ya se ha escrito
+    long long total;             // Suma de las cuentas escritas de los trozos
+    int fin;                     // No llegarán más trozos
+    struct Opciones *op;
+};
+
+// Función para comprobar todas las líneas de un trozo
+void procesarTrozo(struct Buscador *b, int regex_flag, int count_flag, struct Trozo *t) {
+    t->salida.niov = 0;
+    t->salida.bytes = 0;
+    t->cuenta = recorrerLineas(b, regex_flag, count_flag, t->datos, t->datos + t->len, &t->salida, NULL);
+}
+
+// Función que ejecuta cada hilo de búsqueda: coge trozos llenos hasta que se acaba la entrada
+void *hiloBusqueda(void *arg) {
+    struct Pool *pool = arg;
+    struct Buscador buscador; // Cada hilo usa su propia copia de las expresiones regulares
+    clonarBuscador(&buscador, &pool->op->buscador);
+
+    pthread_mutex_lock(&pool->mutex);
+    while (1) {
+        while (pool->asignados == pool->llenados && !pool->fin) {
+            pthread_cond_wait(&pool->hay_trabajo, &pool->mutex);
+        }
+        if (pool->asignados == pool->llenados) {
+            break;
+        }
+        struct Trozo *t = &pool->trozos[pool->asignados++ % pool->ntrozos];
+        pthread_mutex_unlock(&pool->mutex);
+
+        procesarTrozo(&buscador, pool->op->regex_flag, pool->op->count_flag, t);
+
+        pthread_mutex_lock(&pool->mutex);
+        t->estado = TROZO_HECHO;
+        pthread_cond_broadcast(&pool->hecho);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    liberarClon(&buscador);
+    return NULL;
+}
+
+// Función para escribir, en el orden de la entrada, la salida de los trozos hasta el número dado
+void escribirTrozos(struct Pool *pool, long hasta) {
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->escritos < hasta) {
+        struct Trozo *t = &pool->trozos[pool->escritos % pool->ntrozos];
+        while (t->estado != TROZO_HECHO) {
+            pthread_cond_wait(&pool->hecho, &pool->mutex);
+        }
+        pthread_mutex_unlock(&pool->mutex);
+
+        // Los datos del trozo siguen vivos hasta que se libere su hueco
+        escribirVector(STDOUT_FILENO, t->salida.iov, t->salida.niov);
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->total += t->cuenta;
+        t->estado = TROZO_LIBRE;
+        pool->escritos++;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Función para obtener un trozo libre de la cola, escribiendo antes los que lo ocupaban
+struct Trozo *siguienteTrozo(struct Pool *pool) {
+    // El hueco está ocupado por el trozo que se llenó ntrozos posiciones antes
+    escribirTrozos(pool, pool->llenados - pool->ntrozos + 1);
+    return &pool->trozos[pool->llenados % pool->ntrozos];
+}
+
+// Función para entregar un trozo lleno a los hilos de búsqueda
+void entregarTrozo(struct Pool *pool, struct Trozo *t) {
+    pthread_mutex_lock(&pool->mutex);
+    t->estado = TROZO_LLENO;
+    pool->llenados++;
+    pthread_cond_signal(&pool->hay_trabajo);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Función para repartir en trozos una entrada proyectada en memoria
+void repartirProyeccion(struct Pool *pool, const char *inicio, const char *end) {
+    while (inicio < end) {
+        // Cada trozo acaba en el primer salto de línea a partir de TAM_TROZO bytes
+        const char *corte = end;
+        if (end - inicio > TAM_TROZO) {
+            corte = memchr(inicio + TAM_TROZO - 1, '\n', end - inicio - TAM_TROZO + 1);
+            corte = corte == NULL ? end : corte + 1;
+        }
+        struct Trozo *t = siguienteTrozo(pool);
+        t->datos = inicio;
+        t->len = corte - inicio;
+        entregarTrozo(pool, t);
+        inicio = corte;
+    }
+}
+
+// Función para repartir en trozos una entrada leída con read(), pasando la última línea
+// incompleta de cada trozo al principio del siguiente
+void repartirLectura(struct Pool *pool, int bufsize, long long maxlinea) {
+    const char *resto = NULL; // Línea incompleta al final del trozo anterior
+    size_t resto_len = 0;
+    ssize_t bytes_read = 1;
+
+    while (bytes_read > 0) {
+        struct Trozo *t = siguienteTrozo(pool);
+        if (t->capacidad < TAM_TROZO + (size_t)bufsize + resto_len) {
+            t->capacidad = TAM_TROZO + bufsize + resto_len;
+            t->propio = reservar(t->propio, t->capacidad);
+        }
+        // El trozo anterior sigue en otro hueco, así que su resto no se pisa
+        uint64_t t0 = estadisticas.activas ? relojNs() : 0;
+        memcpy(t->propio, resto, resto_len);
+        if (estadisticas.activas && resto_len > 0) {
+            medirEtapa(ETAPA_COPIA, t0);
+            sumarStats(&estadisticas.arrastres, 1);
+            sumarStats(&estadisticas.bytes_arrastrados, resto_len);
+        }
+        size_t len = resto_len;
+        char *ultimo = NULL; // Último salto de línea del trozo
+
+        while (len < TAM_TROZO || ultimo == NULL) {
+            if (t->capacidad - len < (size_t)bufsize) {
+                // Una línea más larga que el trozo: se agranda el buffer
+                t->capacidad *= 2;
+                t->propio = reservar(t->propio, t->capacidad);
+            }
+            bytes_read = leerEntrada(t->propio + len, tamLectura(bufsize, t->capacidad - len));
+            if (bytes_read == -1) {
+                fprintf(stderr, "ERROR: read()\n");
+                exit(EXIT_FAILURE);
+            }
+            if (bytes_read == 0) {
+                break;
+            }
+            char *salto = memrchr(t->propio + len, '\n', bytes_read);
+            if (salto != NULL) {
+                ultimo = salto;
+            }
+            len += bytes_read;
+            comprobarLongitud(t->propio + len - (ultimo != NULL ? ultimo + 1 : t->propio), maxlinea);
+        }
+
+        // Al final de la entrada se entrega todo, incluida una última línea sin '\n'
+        size_t completo = (bytes_read == 0 || ultimo == NULL) ? len : (size_t)(ultimo - t->propio + 1);
+        resto = t->propio + completo;
+        resto_len = len - completo;
+        if (completo > 0) {
+            t->datos = t->propio;
+            t->len = completo;
+            entregarTrozo(pool, t);
+        }
+    }
+}
+
+// Función para buscar en paralelo con varios hilos, manteniendo el orden de la salida
+void minigrepParalelo(struct Opciones *op, int es_regular, off_t size) {
+    struct Pool pool;
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.mutex, NULL);
+    pthread_cond_init(&pool.hay_trabajo, NULL);
+    pthread_cond_init(&pool.hecho, NULL);
+    pool.op = op;
+    pool.ntrozos = 2 * op->hilos; // Suficientes para que los hilos no esperen a la escritura
+    pool.trozos = calloc(pool.ntrozos, sizeof(struct Trozo));
+    for (int i = 0; pool.trozos != NULL && i < pool.ntrozos; i++) {
+        iniciarSalida(&pool.trozos[i].salida, -1, 0);
+    }
+    pthread_t *hilos = malloc(op->hilos * sizeof(pthread_t));
+    if (pool.trozos == NULL || hilos == NULL) {
+        fprintf(stderr, "ERROR: malloc()\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < op->hilos; i++) {
+        if (pthread_create(&hilos[i], NULL, hiloBusqueda, &pool) != 0) {
+            fprintf(stderr, "ERROR: pthread_create()\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    char *map = NULL;
+    if (es_regular) {
+        off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+        if (offset < 0 || offset > size) {
+            offset = 0;
+        }
+        if (size > offset) {
+            map = proyectar(STDIN_FILENO, size);
+            if (map == MAP_FAILED) {
+                fprintf(stderr, "ERROR: mmap()\n");
+                exit(EXIT_FAILURE);
+            }
+            repartirProyeccion(&pool, map + offset, map + size);
+        }
+    } else {
+        repartirLectura(&pool, op->bufsize, op->maxlinea);
+    }
+
+    // Avisar del final y escribir lo que quede pendiente
+    pthread_mutex_lock(&pool.mutex);
+    pool.fin = 1;
+    pthread_cond_broadcast(&pool.hay_trabajo);
+    pthread_mutex_unlock(&pool.mutex);
+    escribirTrozos(&pool, pool.llenados);
+    for (int i = 0; i < op->hilos; i++) {
+        pthread_join(hilos[i], NULL);
+    }
+
+    if (op->count_flag) {
+        printf("%lld\n", pool.total);
+    }
+
+    if (map != NULL) {
+        munmap(map, size);
+    }
+    for (int i = 0; i < pool.ntrozos; i++) {
+        free(pool.trozos[i].propio);
+        free(pool.trozos[i].salida.iov);
+    }
+    free(pool.trozos);
+    free(hilos);
+    pthread_mutex_destroy(&pool.mutex);
+    pthread_cond_destroy(&pool.hay_trabajo);
+    pthread_cond_destroy(&pool.hecho);
+}
+
+// Directorio abierto durante el recorrido, compartido por las tareas de sus entradas
+struct Directorio {
+    int fd;
+    char *ruta;   // Ruta que se muestra delante de sus ficheros
+    int refs;     // Tareas que todavía lo usan, más el hilo que lo está leyendo
+};
+
+// Fichero o directorio pendiente, relativo a su directorio
+struct Tarea {
+    struct Tarea *sig;
+    struct Directorio *dir; // NULL para las rutas de la línea de comandos
+    char nombre[];
+};
+
+// Estado compartido por los hilos que recorren las rutas
+struct Recorrido {
+    pthread_mutex_t mutex;
+    pthread_cond_t hay_tarea;
+    pthread_mutex_t escritura;   // La salida de cada fichero se escribe entera de una vez
+    struct Tarea *pila;          // Tareas pendientes; las de un directorio salen en su orden
+    long pendientes;             // Tareas en la pila o en proceso
+    int errores;
+    int escrito;                 // Ya se ha escrito la salida de algún fichero
+    struct Opciones *op;
+};
+
+// Hilo del recorrido, con buffers que se reutilizan de un fichero a otro
+struct Trabajador {
+    struct Recorrido *rec;
+    struct Buscador buscador;
+    char *buffer;           // Contenido de los ficheros que no se proyectan
+    size_t capacidad;
+    char *inflado;          // Bloque descomprimido de los ficheros gzip
+    size_t capacidad_inflado;
+#ifdef MINIGREP_ZLIB
+    struct Entrada gzip;    // Descompresión del fichero gzip actual
+#endif
+    struct Salida salida;   // Líneas aceptadas del fichero actual
+    int escribiendo;        // El hilo tiene la escritura hasta acabar el fichero actual
+    struct Contexto contexto; // Contexto de -A/-B/-C, con el anillo reutilizado
+    char *ruta;             // Ruta del fichero actual y los prefijos "ruta:" y "ruta-"
+    size_t ruta_cap;
+    char dents[TAM_DENTS];  // Entradas leídas con getdents64()
+};
+
+// Función para avisar de un fichero que no se puede buscar, sin detener el recorrido
+void errorRuta(struct Recorrido *rec, const char *mensaje, const char *ruta) {
+    pthread_mutex_lock(&rec->escritura);
+    fprintf(stderr, "ERROR: %s '%s'\n", mensaje, ruta);
+    pthread_mutex_unlock(&rec->escritura);
+    pthread_mutex_lock(&rec->mutex);
+    rec->errores = 1;
+    pthread_mutex_unlock(&rec->mutex);
+}
+
+// Función para crear una tarea para la entrada nombre del directorio dir
+struct Tarea *nuevaTarea(struct Directorio *dir, const char *nombre) {
+    size_t len = strlen(nombre);
+    struct Tarea *t = reservar(NULL, sizeof(struct Tarea) + len + 1);
+    t->sig = NULL;
+    t->dir = dir;
+    memcpy(t->nombre, nombre, len + 1);
+    return t;
+}
+
+// Función para poner una lista de tareas encima de la pila, conservando su orden
+void apilarTareas(struct Recorrido *rec, struct Tarea *primera, struct Tarea *ultima, long n) {
+    pthread_mutex_lock(&rec->mutex);
+    ultima->sig = rec->pila;
+    rec->pila = primera;
+    rec->pendientes += n;
+    pthread_cond_broadcast(&rec->hay_tarea);
+    pthread_mutex_unlock(&rec->mutex);
+}
+
+// Función para soltar un directorio; el último que lo suelta lo cierra
+void soltarDirectorio(struct Directorio *dir) {
+    if (dir != NULL && __atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(dir->fd);
+        free(dir->ruta);
+        free(dir);
+    }
+}
+
+// Función para escribir en el buffer del hilo la ruta de una tarea
+size_t componerRuta(struct Trabajador *w, struct Tarea *t) {
+    const char *base = t->dir != NULL ? t->dir->ruta : "";
+    size_t base_len = strlen(base);
+    size_t nombre_len = strlen(t->nombre);
+    int barra = base_len > 0 && base[base_len - 1] != '/';
+    size_t len = base_len + barra + nombre_len;
+    if (w->ruta_cap < 2 * len + 3) {
+        w->ruta_cap = 2 * (2 * len + 3);
+        w->ruta = reservar(w->ruta, w->ruta_cap);
+    }
+    memcpy(w->ruta, base, base_len);
+    w->ruta[base_len] = '/';
+    memcpy(w->ruta + base_len + barra, t->nombre, nombre_len + 1);
+    return len;
+}
+
+// Función para leer un directorio con getdents64() y apilar sus entradas. Los enlaces
+// simbólicos y los dispositivos se saltan
+void listarDirectorio(struct Trabajador *w, int fd, const char *ruta) {
+    struct Directorio *dir = reservar(NULL, sizeof(struct Directorio));
+    dir->fd = fd;
+    dir->ruta = strdup(ruta);
+    dir->refs = 1;
+    if (dir->ruta == NULL) {
+        fprintf(stderr, "ERROR: malloc()\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct Tarea *primera = NULL, *ultima = NULL;
+    long n = 0;
+    ssize_t bytes;
+    while ((bytes = getdents64(fd, w->dents, sizeof(w->dents))) > 0) {
+        for (ssize_t off = 0; off < bytes;) {
+            struct dirent64 *e = (struct dirent64 *)(w->dents + off);
+            off += e->d_reclen;
+            if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
+                continue;
+            }
+            unsigned char tipo = e->d_type;
+            if (tipo == DT_UNKNOWN) {
+                // Sistemas de ficheros que no rellenan d_type
+                struct stat st;
+                if (fstatat(fd, e->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                    continue;
+                }
+                tipo = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if (tipo != DT_DIR && tipo != DT_REG) {
+                continue;
+            }
+            struct Tarea *t = nuevaTarea(dir, e->d_name);
+            if (ultima == NULL) {
+                primera = t;
+            } else {
+                ultima->sig = t;
+            }
+            ultima = t;
+            n++;
+        }
+    }
+    if (bytes == -1) {
+        errorRuta(w->rec, "no se puede leer el directorio", ruta);
+    }
+    if (n > 0) {
+        __atomic_add_fetch(&dir->refs, n, __ATOMIC_RELAXED);
+        apilarTareas(w->rec, primera, ultima, n);
+    }
+    soltarDirectorio(dir);
+}
+
+// Función para escribir la salida acumulada del fichero actual. La primera vez el hilo se
+// queda con la escritura hasta acabar el fichero, para que su salida no se mezcle con la de
+// otros, y pone el separador de contexto si ya se ha escrito la de otro fichero
+void escribirFichero(struct Trabajador *w, struct Contexto *ctx) {
+    if (w->salida.niov == 0) {
+        return;
+    }
+    if (!w->escribiendo) {
+        pthread_mutex_lock(&w->rec->escritura);
+        if (ctx != NULL && !w->rec->op->count_flag && w->rec->escrito) {
+            struct iovec separador = {"--\n", 3};
+            escribirVector(STDOUT_FILENO, &separador, 1);
+        }
+        w->rec->escrito = 1;
+        w->escribiendo = 1;
+    }
+    escribirVector(STDOUT_FILENO, w->salida.iov, w->salida.niov);
+    w->salida.niov = 0;
+    w->salida.bytes = 0;
+}
+
+// Función para soltar la escritura al acabar el fichero actual
+void soltarEscritura(struct Trabajador *w) {
+    if (w->escribiendo) {
+        w->escribiendo = 0;
+        pthread_mutex_unlock(&w->rec->escritura);
+    }
+}
+
+#ifdef MINIGREP_ZLIB
+// Función para preparar la descompresión del fichero actual. Lo comprimido empieza por
+// [datos, datos + len), ya leído o proyectado; si fd no es -1, el resto se lee de fd
+void iniciarGzipFichero(struct Trabajador *w, int fd, const char *datos, size_t len) {
+    struct Entrada *e = &w->gzip;
+    unsigned char *comprimido = e->comprimido; // El buffer de lectura se reutiliza
+    memset(e, 0, sizeof(*e));
+    if (inflateInit2(&e->z, 16 + MAX_WBITS) != Z_OK) {
+        fprintf(stderr, "ERROR: inflateInit2()\n");
+        exit(EXIT_FAILURE);
+    }
+    e->z.next_in = (unsigned char *)datos;
+    e->z.avail_in = len;
+    e->fin_lectura = fd == -1;
+    if (fd != -1 && comprimido == NULL) {
+        comprimido = reservar(NULL, TAM_GZIP);
+    }
+    e->comprimido = comprimido;
+}
+#endif
+
+// Función para leer el siguiente bloque del fichero actual, descomprimiéndolo si es gzip
+ssize_t leerBloque(struct Trabajador *w, int fd, int comprimido, char *buf, size_t len) {
+#ifdef MINIGREP_ZLIB
+    if (comprimido) {
+        return inflarEntrada(&w->gzip, fd, buf, len);
+    }
+#endif
+    (void)w;
+    (void)comprimido;
+    return leer(fd, buf, len);
+}
+
+// Función para buscar en el fichero actual por bloques sin tenerlo entero en memoria. Las
+// líneas completas se buscan en su sitio, como hace minigrepLectura() con la entrada estándar,
+// y la incompleta del final se arrastra al principio del buffer, que solo crece con las líneas
+// largas. Los gzip se descomprimen en w->inflado; el resto se lee en w->buffer, que ya trae
+// lleno bytes. Antes de mover el buffer se escribe la salida que apunta a él, y con inmediata
+// también tras cada bloque, para que la de un pipe salga según llega. Devuelve las líneas
+// aceptadas, o -1 si falla la lectura, está dañado o una línea pasa de -L, con el motivo en error
+long long buscarBloques(struct Trabajador *w, int fd, int comprimido, size_t lleno, int inmediata, struct Contexto *ctx, const char **error) {
+    struct Opciones *op = w->rec->op;
+    char **buffer = comprimido ? &w->inflado : &w->buffer;
+    size_t *capacidad = comprimido ? &w->capacidad_inflado : &w->capacidad;
+    size_t minimo = 4 * (size_t)op->bufsize > MIN_LECTURA ? 4 * (size_t)op->bufsize : MIN_LECTURA;
+    if (*capacidad < minimo) {
+        *capacidad = minimo;
+        *buffer = reservar(*buffer, minimo);
+    }
+    size_t pendiente = 0; // Principio de la línea incompleta
+    long long cuenta = 0;
+    ssize_t n = lleno;    // Lo ya leído se busca como un bloque más
+    lleno = 0;
+    while (1) {
+        if (n > 0) {
+            char *ultimo = memrchr(*buffer + lleno, '\n', n);
+            lleno += n;
+            if (ultimo != NULL) {
+                cuenta += recorrerLineas(&w->buscador, op->regex_flag, op->count_flag, *buffer + pendiente, ultimo + 1, &w->salida, ctx);
+                pendiente = ultimo + 1 - *buffer;
+                if (inmediata) {
+                    escribirFichero(w, ctx);
+                }
+            }
+            if (op->maxlinea > 0 && lleno - pendiente > (unsigned long long)op->maxlinea) {
+                *error = "línea demasiado larga en";
+                return -1;
+            }
+        }
+
+        if (*capacidad - lleno < (size_t)op->bufsize) {
+            // Se conservan la línea incompleta y las anteriores que aún pueden hacer falta
+            // como contexto
+            escribirFichero(w, ctx);
+            size_t desde = pendiente - contextoRetenido(ctx);
+            if (desde > 0) {
+                uint64_t t0 = estadisticas.activas ? relojNs() : 0;
+                memmove(*buffer, *buffer + desde, lleno - desde);
+                if (estadisticas.activas) {
+                    medirEtapa(ETAPA_COPIA, t0);
+                    sumarStats(&estadisticas.arrastres, 1);
+                    sumarStats(&estadisticas.bytes_arrastrados, lleno - desde);
+                }
+                lleno -= desde;
+                pendiente -= desde;
+            }
+            if (*capacidad - lleno < (size_t)op->bufsize) {
+                *capacidad *= 2;
+                *buffer = reservar(*buffer, *capacidad);
+            }
+        }
+
+        n = leerBloque(w, fd, comprimido, *buffer + lleno, *capacidad - lleno);
+        if (n == -1 && errno == EINTR && !comprimido) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+    }
+    if (n == -1) {
+        *error = "no se puede leer";
+#ifdef MINIGREP_ZLIB
+        if (comprimido && w->gzip.error != NULL) {
+            *error = "no es un gzip válido";
+        }
+#endif
+        return -1;
+    }
+    if (pendiente < lleno) {
+        cuenta += recorrerLineas(&w->buscador, op->regex_flag, op->count_flag, *buffer + pendiente, *buffer + lleno, &w->salida, ctx);
+    }
+    return cuenta;
+}
+
+// Función para buscar en un fichero abierto y escribir su salida. Los ficheros regulares
+// grandes se proyectan y se buscan enteros; el resto se lee por bloques, igual que se
+// descomprimen los gzip, así que su salida puede salir en varias escrituras
+void buscarFichero(struct Trabajador *w, int fd, struct stat *st, size_t ruta_len) {
+    struct Opciones *op = w->rec->op;
+    char *datos = NULL;
+    size_t len = 0;
+    int proyectado = 0;
+
+    if (op->modo != MODO_READ && S_ISREG(st->st_mode) && (st->st_size >= MIN_PROYECCION || op->modo == MODO_MMAP)) {
+        if (st->st_size > 0) {
+            datos = proyectar(fd, st->st_size);
+            if (datos == MAP_FAILED) {
+                errorRuta(w->rec, "mmap() ha fallado en", w->ruta);
+                return;
+            }
+            len = st->st_size;
+            proyectado = 1;
+        }
+    } else {
+        // Primer bloque, con al menos la cabecera que dice si es gzip
+        size_t minimo = 4 * (size_t)op->bufsize > MIN_LECTURA ? 4 * (size_t)op->bufsize : MIN_LECTURA;
+        if (w->capacidad < minimo) {
+            w->capacidad = minimo;
+            w->buffer = reservar(w->buffer, minimo);
+        }
+        ssize_t bytes_read = 0;
+        while (len < 2) {
+            bytes_read = leer(fd, w->buffer + len, w->capacidad - len);
+            if (bytes_read == -1 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_read <= 0) {
+                break;
+            }
+            len += bytes_read;
+        }
+        if (bytes_read == -1) {
+            errorRuta(w->rec, "no se puede leer", w->ruta);
+            return;
+        }
+        datos = w->buffer;
+    }
+
+    // Prefijo "ruta:" con el ':' justo detrás de la ruta
+    w->salida.niov = 0;
+    w->salida.bytes = 0;
+    w->salida.prefijo = NULL;
+    w->salida.prefijo_contexto = NULL;
+    if (op->nombres) {
+        // Detrás va una copia con '-' para las líneas de contexto
+        w->ruta[ruta_len] = ':';
+        memcpy(w->ruta + ruta_len + 1, w->ruta, ruta_len);
+        w->ruta[2 * ruta_len + 1] = '-';
+        w->salida.prefijo = w->ruta;
+        w->salida.prefijo_contexto = w->ruta + ruta_len + 1;
+        w->salida.prefijo_len = ruta_len + 1;
+    }
+    struct Contexto *ctx = NULL;
+    if (op->antes >= 0) {
+        reiniciarContexto(&w->contexto);
+        ctx = &w->contexto;
+    }
+    long long cuenta = 0;
+    int comprimido = 0;
+    const char *error = "no es un gzip válido";
+    int inmediata = !S_ISREG(st->st_mode);
+#ifdef MINIGREP_ZLIB
+    comprimido = op->descomprimir || esGzip((unsigned char *)datos, len);
+    if (comprimido && !esGzip((unsigned char *)datos, len)) {
+        cuenta = -1;
+    } else if (comprimido) {
+        iniciarGzipFichero(w, proyectado ? -1 : fd, datos, len);
+        cuenta = buscarBloques(w, proyectado ? -1 : fd, 1, 0, inmediata, ctx, &error);
+        inflateEnd(&w->gzip.z);
+    }
+#endif
+    if (!comprimido && proyectado) {
+        cuenta = recorrerLineas(&w->buscador, op->regex_flag, op->count_flag, datos, datos + len, &w->salida, ctx);
+    } else if (!comprimido) {
+        cuenta = buscarBloques(w, fd, 0, len, inmediata, ctx, &error);
+    }
+    if (cuenta == -1) {
+        // Lo que ya se haya escrito antes del error se queda, como con zcat
+        soltarEscritura(w);
+        w->salida.niov = 0;
+        w->salida.bytes = 0;
+        w->ruta[ruta_len] = '\0';
+        errorRuta(w->rec, error, w->ruta);
+    } else {
+        char texto[32];
+        if (op->count_flag) {
+            int n = snprintf(texto, sizeof(texto), "%lld\n", cuenta);
+            anadirSalida(&w->salida, texto, texto + n);
+        }
+        escribirFichero(w, ctx);
+        soltarEscritura(w);
+    }
+    w->ruta[ruta_len] = '\0';
+
+    if (proyectado) {
+        munmap(datos, len);
+    }
+}
+
+// Función para procesar una tarea: buscar en el fichero o apilar las entradas del directorio
+void procesarTarea(struct Trabajador *w, struct Tarea *t) {
+    size_t ruta_len = componerRuta(w, t);
+    int fd;
+    if (t->dir == NULL && strcmp(t->nombre, "-") == 0) {
+        fd = STDIN_FILENO;
+    } else {
+        fd = openat(t->dir != NULL ? t->dir->fd : AT_FDCWD, t->nombre, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+        if (fd == -1) {
+            errorRuta(w->rec, "no se puede abrir", w->ruta);
+            return;
+        }
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        errorRuta(w->rec, "no se puede leer", w->ruta);
+    } else if (S_ISDIR(st.st_mode)) {
+        if (w->rec->op->recursivo) {
+            listarDirectorio(w, fd, w->ruta); // El descriptor pasa a ser del directorio
+            return;
+        }
+        errorRuta(w->rec, "es un directorio", w->ruta);
+    } else {
+        buscarFichero(w, fd, &st, ruta_len);
+    }
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+}
+
+// Función que ejecuta cada hilo del recorrido: coge tareas hasta que no queda ninguna
+void *hiloRecorrido(void *arg) {
+    struct Trabajador *w = arg;
+    struct Recorrido *rec = w->rec;
+
+    pthread_mutex_lock(&rec->mutex);
+    while (1) {
+        while (rec->pila == NULL && rec->pendientes > 0) {
+            pthread_cond_wait(&rec->hay_tarea, &rec->mutex);
+        }
+        if (rec->pila == NULL) {
+            break;
+        }
+        struct Tarea *t = rec->pila;
+        rec->pila = t->sig;
+        pthread_mutex_unlock(&rec->mutex);
+
+        procesarTarea(w, t);
+        soltarDirectorio(t->dir);
+        free(t);
+
+        pthread_mutex_lock(&rec->mutex);
+        if (--rec->pendientes == 0) {
+            // Ya no se van a apilar más tareas
+            pthread_cond_broadcast(&rec->hay_tarea);
+        }
+    }
+    pthread_mutex_unlock(&rec->mutex);
+    return NULL;
+}
+
+// Función para buscar en varias rutas a la vez. El hilo principal hace de primer trabajador.
+// Devuelve 1 si alguna ruta no se ha podido buscar
+int minigrepRutas(struct Opciones *op) {
+    struct Recorrido rec;
+    memset(&rec, 0, sizeof(rec));
+    pthread_mutex_init(&rec.mutex, NULL);
+    pthread_cond_init(&rec.hay_tarea, NULL);
+    pthread_mutex_init(&rec.escritura, NULL);
+    rec.op = op;
+
+    // Las rutas de la línea de comandos, en orden
+    char *actual[] = {"."};
+    char **rutas = op->nrutas > 0 ? op->rutas : actual;
+    int nrutas = op->nrutas > 0 ? op->nrutas : 1;
+    struct Tarea *primera = NULL, *ultima = NULL;
+    for (int i = 0; i < nrutas; i++) {
+        struct Tarea *t = nuevaTarea(NULL, rutas[i]);
+        if (ultima == NULL) {
+            primera = t;
+        } else {
+            ultima->sig = t;
+        }
+        ultima = t;
+    }
+    apilarTareas(&rec, primera, ultima, nrutas);
+
+    struct Trabajador *trabajadores = calloc(op->hilos, sizeof(struct Trabajador));
+    pthread_t *hilos = malloc(op->hilos * sizeof(pthread_t));
+    if (trabajadores == NULL || hilos == NULL) {
+        fprintf(stderr, "ERROR: malloc()\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < op->hilos; i++) {
+        trabajadores[i].rec = &rec;
+        clonarBuscador(&trabajadores[i].buscador, &op->buscador);
+        iniciarSalida(&trabajadores[i].salida, -1, 0);
+        if (op->antes >= 0) {
+            iniciarContexto(&trabajadores[i].contexto, op->antes, op->despues);
+        }
+    }
+    for (int i = 1; i < op->hilos; i++) {
+        if (pthread_create(&hilos[i], NULL, hiloRecorrido, &trabajadores[i]) != 0) {
+            fprintf(stderr, "ERROR: pthread_create()\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    hiloRecorrido(&trabajadores[0]);
+    for (int i = 1; i < op->hilos; i++) {
+        pthread_join(hilos[i], NULL);
+    }
+
+    for (int i = 0; i < op->hilos; i++) {
+        liberarClon(&trabajadores[i].buscador);
+        free(trabajadores[i].buffer);
+        free(trabajadores[i].inflado);
+#ifdef MINIGREP_ZLIB
+        free(trabajadores[i].gzip.comprimido);
+#endif
+        free(trabajadores[i].salida.iov);
+        free(trabajadores[i].ruta);
+        free(trabajadores[i].contexto.anillo);
+    }
+    free(trabajadores);
+    free(hilos);
+    pthread_mutex_destroy(&rec.mutex);
+    pthread_cond_destroy(&rec.hay_tarea);
+    pthread_mutex_destroy(&rec.escritura);
+    return rec.errores;
+}
+
+// Función principal que ejecuta la lógica principal del programa
+void minigrep(struct Opciones *op) {
+    struct Buscador *b = &op->buscador;
+    int regex_flag = op->regex_flag;
+    int bufsize = op->bufsize;
+    int count_flag = op->count_flag;
+    int modo = op->modo;
+
+    // Si la entrada es un fichero regular se puede proyectar en memoria y evitar las copias
+    struct stat st;
+    int es_regular = fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode);
+    if (modo == MODO_MMAP && !es_regular) {
+        fprintf(stderr, "ERROR: mmap necesita que la entrada sea un fichero regular\n");
+        exit(EXIT_FAILURE);
+    }
+    // El contexto cruza los bordes de los trozos, así que con -A/-B/-C se busca en un solo hilo
+    struct Contexto contexto;
+    struct Contexto *ctx = NULL;
+    if (op->antes >= 0 && !count_flag) {
+        iniciarContexto(&contexto, op->antes, op->despues);
+        ctx = &contexto;
+    }
+#ifdef MINIGREP_ZLIB
+    detectarGzip(es_regular);
+    if (op->descomprimir && !entrada.gzip) {
+        fprintf(stderr, "ERROR: la entrada no está comprimida con gzip\n");
+        exit(EXIT_FAILURE);
+    }
+    if (entrada.gzip) {
+        if (modo == MODO_MMAP) {
+            fprintf(stderr, "ERROR: mmap no sirve con una entrada comprimida\n");
+            exit(EXIT_FAILURE);
+        }
+        // El hilo principal descomprime en los trozos mientras los hilos de búsqueda comprueban
+        // los anteriores; con -j 1 son dos trozos que se alternan. El contexto no se reparte,
+        // así que con -A/-B/-C se descomprime y se busca en el mismo hilo
+        iniciarGzip();
+        if (ctx == NULL) {
+            minigrepParalelo(op, 0, 0);
+        } else {
+            minigrepLectura(b, regex_flag, count_flag, bufsize, op->maxlinea, ctx);
+            free(ctx->anillo);
+        }
+        terminarGzip();
+        return;
+    }
+#endif
+    if (op->hilos > 1 && ctx == NULL) {
+        minigrepParalelo(op, modo != MODO_READ && es_regular, st.st_size);
+        return;
+    }
+    if (modo != MODO_READ && es_regular) {
+        minigrepMmap(b, regex_flag, count_flag, bufsize, st.st_size, ctx);
+    } else {
+        minigrepLectura(b, regex_flag, count_flag, bufsize, op->maxlinea, ctx);
+    }
+    if (ctx != NULL) {
+        free(ctx->anillo);
+    }
+}
+
+// Función para escribir el informe de --stats por la salida de error al terminar
+void imprimirEstadisticas(void) {
+    static const char *etapas[NUM_ETAPAS] = {"read():   ", "mmap():   ", "arrastre: ", "búsqueda: ", "writev(): ", "inflate():"};
+    struct Estadisticas *e = &estadisticas;
+    fflush(stdout); // La cuenta de -c va antes que el informe
+    double total = (relojNs() - e->inicio) / 1e9;
+    fprintf(stderr, "--- minigrep --stats ---\n");
+    fprintf(stderr, "tiempo total:  %.6f s\n", total);
+    fprintf(stderr, "bytes:         %llu (%.3f GB/s)\n", (unsigned long long)e->bytes, total > 0 ? e->bytes / total / 1e9 : 0.0);
+    fprintf(stderr, "líneas:        %llu (%.0f líneas/s), %llu aceptadas\n", (unsigned long long)e->lineas,
+            total > 0 ? e->lineas / total : 0.0, (unsigned long long)e->aceptadas);
+    fprintf(stderr, "read():        %llu llamadas, %llu bytes\n", (unsigned long long)e->lecturas, (unsigned long long)e->bytes_leidos);
+    fprintf(stderr, "writev():      %llu llamadas, %llu bytes\n", (unsigned long long)e->escrituras, (unsigned long long)e->bytes_escritos);
+    fprintf(stderr, "arrastre:      %llu veces, %llu bytes (%.2f%% de lo leído)\n", (unsigned long long)e->arrastres,
+            (unsigned long long)e->bytes_arrastrados, e->bytes_leidos > 0 ? 100.0 * e->bytes_arrastrados / e->bytes_leidos : 0.0);
+    fprintf(stderr, "tiempo por etapa (sumado entre hilos):\n");
+    for (int i = 0; i < NUM_ETAPAS; i++) {
+        fprintf(stderr, "  %s%.6f s\n", etapas[i], e->ns[i] / 1e9);
+    }
+    fprintf(stderr, "longitud de línea:\n");
+    for (int i = 0; i < NUM_CUBETAS; i++) {
+        if (e->cubetas[i] == 0) {
+            continue;
+        }
+        if (i == 0) {
+            fprintf(stderr, "  %22s %llu\n", "0", (unsigned long long)e->cubetas[i]);
+        } else if (i == NUM_CUBETAS - 1) {
+            char rango[48];
+            snprintf(rango, sizeof(rango), ">= %llu", 1ULL << (i - 1));
+            fprintf(stderr, "  %22s %llu\n", rango, (unsigned long long)e->cubetas[i]);
+        } else {
+            char rango[48];
+            snprintf(rango, sizeof(rango), "[%llu, %llu)", 1ULL << (i - 1), 1ULL << i);
+            fprintf(stderr, "  %22s %llu\n", rango, (unsigned long long)e->cubetas[i]);
+        }
+    }
+}
+
+// Función principal del programa
+int main(int argc, char *argv[]) {
+    struct Opciones op;
+    memset(&op, 0, sizeof(op));
+    op.bufsize = DEFAULT_BUFSIZE; // Tamaño del buffer por defecto que usaremos para leer y escribir
+    op.modo = MODO_AUTO;          // Forma de leer la entrada
+    op.hilos = 1;                 // Sin hilos de búsqueda adicionales
+    op.motor = MOTOR_AUTO;        // DFA siempre que la expresión lo permita
+    op.antes = -1;                // Sin líneas de contexto
+    op.despues = -1;
+
+    procesarArgumentos(argc, argv, &op);                         // Coger parametros con getopt
+    verificarArgumentos(op.bufsize, op.regex_flag, op.hilos);    // Comprobar si los parametros estan en nuestro rango
+    elegirSimd();                                                // Versiones vectoriales según la CPU
+    if (estadisticas.activas) {
+        estadisticas.inicio = relojNs();
+        atexit(imprimirEstadisticas);                            // Informe al terminar, también con error
+    }
+    prepararBuscador(&op.buscador, &op);                         // Literales, expresiones y motor
+    if (op.nrutas == 1 && !op.recursivo && !op.nombres && strcmp(op.rutas[0], "-") != 0) {
+        // Un solo fichero se busca como si fuera la entrada estándar, con -j por trozos. Con -H
+        // hace falta el prefijo de la ruta, que solo pone la búsqueda por rutas
+        int fd = open(op.rutas[0], O_RDONLY);
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) != 0) {
+            fprintf(stderr, "ERROR: no se puede abrir '%s'\n", op.rutas[0]);
+            exit(EXIT_FAILURE);
+        }
+        if (S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "ERROR: es un directorio '%s'\n", op.rutas[0]);
+            exit(EXIT_FAILURE);
+        }
+        dup2(fd, STDIN_FILENO);
+        close(fd);
+    } else if (op.nrutas > 0 || op.recursivo) {
+        return minigrepRutas(&op) ? EXIT_FAILURE : EXIT_SUCCESS; // Varios ficheros a la vez
+    }
+    minigrep(&op);                                               // Procesar lineas
     return EXIT_SUCCESS;
 }
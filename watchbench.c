@@ -0,0 +1,704 @@
+#define _GNU_SOURCE
+// Bibliotecas necesarias
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <linux/magic.h>
+
+// Valores por defecto
+#define DEFAULT_DIR "/dev/shm/watchbench"
+#define DEFAULT_BINARIO "./watchdir"
+#define DEFAULT_ENTRADAS "10000,100000"
+#define DEFAULT_OPCIONES "-p,-p -j 4,"
+#define DEFAULT_CARGAS "creacion,renombrado,tamano,borrado"
+#define DEFAULT_CAMBIOS 1000
+#define DEFAULT_INTERVALO "0.5"
+#define DEFAULT_REPOSO 5.0
+
+#define MAX_ARGUMENTOS 64        // Argumentos de cada ejecución de watchdir
+#define TAM_LECTURA 65536        // Lectura del registro de watchdir
+#define MUESTREO_NS 1000000      // Periodo de muestreo del registro y de la CPU (1 ms)
+#define MAX_ARRANQUE 600         // Segundos que se espera al primer escaneo
+#define FACTOR_ESPERA 8          // Espera adaptativa máxima de watchdir, en intervalos
+#define MAX_MOSTRADOS 5          // Líneas que faltan o sobran que se muestran por medida
+
+// Cargas de cambios que se aplican al árbol
+enum { CARGA_CREACION, CARGA_RENOMBRADO, CARGA_TAMANO, CARGA_BORRADO };
+static const char *nombresCarga[] = {"creacion", "renombrado", "tamano", "borrado"};
+#define NCARGAS (int)(sizeof(nombresCarga) / sizeof(nombresCarga[0]))
+
+// Opciones de la línea de comandos
+struct Opciones {
+    const char *dir;        // Directorio de trabajo, mejor en tmpfs
+    const char *binario;    // watchdir que se mide
+    char *entradas;         // Lista de tamaños del árbol separados por comas
+    long anchura;           // Ficheros por subdirectorio; 0 pone todos en la raíz
+    char *opciones;         // Lista de conjuntos de opciones separados por comas
+    char *cargas;           // Lista de cargas separadas por comas
+    long cambios;           // Cambios que aplica cada carga
+    const char *intervalo;  // -n de watchdir
+    double reposo;          // Segundos sin cambios en los que se miden los escaneos
+};
+
+// Línea que se espera en el registro por cada cambio aplicado
+struct Esperado {
+    char *clave;
+    double instante;        // Cuando se aplicó el cambio
+    double llegada;         // Cuando apareció la línea; 0 si no ha aparecido
+};
+
+// Estado de una medida: líneas esperadas indexadas por clave y lectura del registro
+struct Medida {
+    struct Esperado *esperados;
+    int numEsperados;
+    int *tabla;             // Direccionamiento abierto; -1 es un hueco
+    int tamTabla;
+    int recibidos;
+    int sobran;             // Líneas que no se esperaban, o repetidas
+    int listo;              // Ha aparecido un centinela: el primer escaneo ha terminado
+    int cargando;           // Se está aplicando la carga
+    long iniciales;         // Creaciones del primer escaneo, que registra el árbol entero
+    double ultimaLlegada;
+    int fdRegistro;
+    char pendiente[TAM_LECTURA];
+    size_t usado;
+};
+
+// Escaneos observados durante el reposo
+struct Escaneos {
+    int ticks;
+    double ms;              // Media de tiempo real por escaneo
+    double cpuMs;           // Media de CPU por escaneo, sumando todos los hilos
+    double maxMs;
+};
+
+// Función para imprimir el uso del programa
+void printUso(int exit_code) {
+    fprintf(stderr, "Uso: ./watchbench [-d DIR] [-b WATCHDIR] [-e ENTRADAS] [-a ANCHURA] [-o OPCIONES] [-w CARGAS] [-k CAMBIOS] [-n SEGUNDOS] [-q SEGUNDOS] [-h]\n"
+                    "\t-d DIR Directorio de trabajo, mejor en tmpfs (por defecto, %s).\n"
+                    "\t-b WATCHDIR Programa que se mide (por defecto, %s).\n"
+                    "\t-e ENTRADAS Tamaños del árbol separados por comas (por defecto, %s).\n"
+                    "\t-a ANCHURA Ficheros por subdirectorio; con ANCHURA se añade -R (por defecto, 0: todos en la raíz).\n"
+                    "\t-o OPCIONES Conjuntos de opciones de watchdir separados por comas; vacío es inotify (por defecto, \"%s\").\n"
+                    "\t-w CARGAS Cargas separadas por comas: creacion, renombrado, tamano, borrado (por defecto, todas).\n"
+                    "\t-k CAMBIOS Cambios que aplica cada carga (por defecto, %d).\n"
+                    "\t-n SEGUNDOS Intervalo de escaneo de watchdir (por defecto, %s).\n"
+                    "\t-q SEGUNDOS Reposo antes de la carga en el que se miden los escaneos (por defecto, %.0f).\n"
+                    "La salida es una línea JSON por medida. Termina con error si alguna medida no registra\n"
+                    "exactamente los cambios aplicados.\n\n",
+            DEFAULT_DIR, DEFAULT_BINARIO, DEFAULT_ENTRADAS, DEFAULT_OPCIONES, DEFAULT_CAMBIOS, DEFAULT_INTERVALO,
+            DEFAULT_REPOSO);
+    exit(exit_code);
+}
+
+// Función para procesar los argumentos de la línea de comandos
+void procesarArgumentos(int argc, char *argv[], struct Opciones *op) {
+    int opt;
+    while ((opt = getopt(argc, argv, "d:b:e:a:o:w:k:n:q:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            op->dir = optarg;
+            break;
+        case 'b':
+            op->binario = optarg;
+            break;
+        case 'e':
+            op->entradas = optarg;
+            break;
+        case 'a':
+            op->anchura = atol(optarg);
+            if (op->anchura < 0) {
+                fprintf(stderr, "ERROR: ANCHURA no puede ser negativa\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'o':
+            op->opciones = optarg;
+            break;
+        case 'w':
+            op->cargas = optarg;
+            break;
+        case 'k':
+            op->cambios = atol(optarg);
+            if (op->cambios < 1) {
+                fprintf(stderr, "ERROR: CAMBIOS debe ser mayor que 0\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'n':
+            if (atof(optarg) <= 0) {
+                fprintf(stderr, "ERROR: el intervalo debe ser mayor que 0\n");
+                exit(EXIT_FAILURE);
+            }
+            op->intervalo = optarg;
+            break;
+        case 'q':
+            op->reposo = atof(optarg);
+            if (op->reposo < 0) {
+                fprintf(stderr, "ERROR: el reposo no puede ser negativo\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'h':
+            printUso(EXIT_SUCCESS);
+            break;
+        default:
+            printUso(EXIT_FAILURE);
+        }
+    }
+}
+
+// Función para leer el reloj monotónico en segundos
+double ahora(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// Función para esperar un periodo de muestreo
+void dormir(void) {
+    struct timespec t = {0, MUESTREO_NS};
+    nanosleep(&t, NULL);
+}
+
+// Función para formar el nombre de una entrada del árbol relativo a la raíz. Con anchura, la
+// entrada i vive en el subdirectorio d(i / anchura)
+void nombreEntrada(char *buf, size_t tam, long anchura, char prefijo, long i) {
+    if (anchura > 0) {
+        snprintf(buf, tam, "d%ld/%c%ld", i / anchura, prefijo, i);
+    } else {
+        snprintf(buf, tam, "%c%ld", prefijo, i);
+    }
+}
+
+// Función para crear un fichero vacío
+void crearFichero(int raiz, const char *nombre) {
+    int fd = openat(raiz, nombre, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "ERROR: no se puede crear '%s'\n", nombre);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+// Función para quitar una entrada de nftw()
+int quitar(const char *ruta, const struct stat *st, int tipo, struct FTW *ftw) {
+    (void)st;
+    (void)tipo;
+    (void)ftw;
+    return remove(ruta);
+}
+
+// Función para crear el árbol de entradas vacías. Devuelve el descriptor de la raíz
+int rellenarArbol(const char *raiz, long entradas, long anchura) {
+    if (nftw(raiz, quitar, 64, FTW_DEPTH | FTW_PHYS) == -1 && errno != ENOENT) {
+        fprintf(stderr, "ERROR: no se puede borrar '%s'\n", raiz);
+        exit(EXIT_FAILURE);
+    }
+    if (mkdir(raiz, 0755) == -1) {
+        fprintf(stderr, "ERROR: no se puede crear '%s'\n", raiz);
+        exit(EXIT_FAILURE);
+    }
+    int fd = open(raiz, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "ERROR: no se puede abrir '%s'\n", raiz);
+        exit(EXIT_FAILURE);
+    }
+    char nombre[64];
+    for (long i = 0; i < entradas; i++) {
+        if (anchura > 0 && i % anchura == 0) {
+            snprintf(nombre, sizeof(nombre), "d%ld", i / anchura);
+            if (mkdirat(fd, nombre, 0755) == -1) {
+                fprintf(stderr, "ERROR: no se puede crear '%s'\n", nombre);
+                exit(EXIT_FAILURE);
+            }
+        }
+        nombreEntrada(nombre, sizeof(nombre), anchura, 'f', i);
+        crearFichero(fd, nombre);
+    }
+    return fd;
+}
+
+// Función para calcular el hash de una clave (FNV-1a)
+uint32_t hashClave(const char *s) {
+    uint32_t h = 2166136261u;
+    for (; *s != '\0'; s++) {
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    }
+    return h;
+}
+
+// Función para buscar una clave entre las líneas esperadas. Devuelve su índice o -1
+int buscarEsperado(const struct Medida *m, const char *clave) {
+    for (uint32_t i = hashClave(clave) & (m->tamTabla - 1);; i = (i + 1) & (m->tamTabla - 1)) {
+        if (m->tabla[i] == -1) {
+            return -1;
+        }
+        if (strcmp(m->esperados[m->tabla[i]].clave, clave) == 0) {
+            return m->tabla[i];
+        }
+    }
+}
+
+// Función para añadir la línea que debe producir un cambio
+void anadirEsperado(struct Medida *m, const char *clave) {
+    int j = m->numEsperados++;
+    m->esperados[j].clave = strdup(clave);
+    m->esperados[j].instante = 0;
+    m->esperados[j].llegada = 0;
+    uint32_t i = hashClave(clave) & (m->tamTabla - 1);
+    while (m->tabla[i] != -1) {
+        i = (i + 1) & (m->tamTabla - 1);
+    }
+    m->tabla[i] = j;
+}
+
+// Función para saber si un nombre es uno de los subdirectorios del árbol
+int esSubdirectorio(const char *nombre) {
+    if (nombre[0] != 'd' || nombre[1] == '\0') {
+        return 0;
+    }
+    for (nombre++; *nombre != '\0'; nombre++) {
+        if (*nombre < '0' || *nombre > '9') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Función para comprobar una línea del registro contra las esperadas. La clave es la línea
+// sin los valores de tamaño, fecha o hash, que no se conocen de antemano. Antes de la carga
+// solo se cuentan las creaciones del primer escaneo. Los centinelas y los subdirectorios (su
+// fecha y tamaño cambian con cada entrada) no cuentan
+void procesarLinea(struct Medida *m, char *linea, double instante) {
+    if (strstr(linea, ": centinela") != NULL) {
+        m->listo = 1;
+        return;
+    }
+    char *nombre = strstr(linea, ": ");
+    if (nombre == NULL) {
+        m->sobran++;
+        return;
+    }
+    nombre += 2;
+    if (strncmp(linea, "UpdateSize: ", 12) == 0 || strncmp(linea, "UpdateMtim: ", 12) == 0 ||
+        strncmp(linea, "UpdateContent: ", 15) == 0) {
+        char *valores = strstr(nombre, ": ");
+        if (valores != NULL) {
+            *valores = '\0';
+        }
+    }
+    if (esSubdirectorio(nombre)) {
+        return;
+    }
+    if (!m->cargando && strncmp(linea, "Creation: ", 10) == 0) {
+        m->iniciales++;
+        return;
+    }
+    int j = buscarEsperado(m, linea);
+    if (j == -1 || m->esperados[j].llegada != 0) {
+        if (m->sobran++ < MAX_MOSTRADOS) {
+            fprintf(stderr, "sobra: %s\n", linea);
+        }
+        return;
+    }
+    m->esperados[j].llegada = instante;
+    m->recibidos++;
+    m->ultimaLlegada = instante;
+}
+
+// Función para leer lo que watchdir haya añadido al registro y procesar las líneas completas
+void leerRegistro(struct Medida *m) {
+    ssize_t n;
+    while ((n = read(m->fdRegistro, m->pendiente + m->usado, sizeof(m->pendiente) - 1 - m->usado)) > 0) {
+        double instante = ahora();
+        m->usado += n;
+        m->pendiente[m->usado] = '\0';
+        char *p = m->pendiente, *salto;
+        while ((salto = strchr(p, '\n')) != NULL) {
+            *salto = '\0';
+            procesarLinea(m, p, instante);
+            p = salto + 1;
+        }
+        m->usado -= p - m->pendiente;
+        memmove(m->pendiente, p, m->usado);
+        if (m->usado == sizeof(m->pendiente) - 1) {
+            m->usado = 0; // Una línea que no cabe no puede ser de las esperadas
+            m->sobran++;
+        }
+    }
+}
+
+// Función para sumar la CPU en nanosegundos de todos los hilos de un proceso (schedstat)
+long long cpuProceso(pid_t pid) {
+    char ruta[PATH_MAX];
+    snprintf(ruta, sizeof(ruta), "/proc/%d/task", (int)pid);
+    DIR *d = opendir(ruta);
+    if (d == NULL) {
+        return 0;
+    }
+    long long total = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.') {
+            continue;
+        }
+        char linea[128];
+        snprintf(ruta, sizeof(ruta), "/proc/%d/task/%s/schedstat", (int)pid, e->d_name);
+        int fd = open(ruta, O_RDONLY);
+        if (fd == -1) {
+            continue;
+        }
+        ssize_t n = read(fd, linea, sizeof(linea) - 1);
+        close(fd);
+        if (n > 0) {
+            linea[n] = '\0';
+            total += atoll(linea);
+        }
+    }
+    closedir(d);
+    return total;
+}
+
+// Función para medir los escaneos de watchdir mientras no hay cambios. Se muestrea su CPU cada
+// milisegundo y cada racha de muestras con consumo es un escaneo
+void medirReposo(pid_t pid, double segundos, struct Escaneos *r) {
+    memset(r, 0, sizeof(*r));
+    double fin = ahora() + segundos, anterior = ahora(), inicio = 0, ultimo = 0, sumaMs = 0;
+    long long cpu = cpuProceso(pid), cpuInicio = 0, sumaCpu = 0;
+    int enRacha = 0;
+    while (ahora() < fin || enRacha) {
+        dormir();
+        long long c = cpuProceso(pid);
+        double t = ahora();
+        if (c > cpu) {
+            if (!enRacha) {
+                enRacha = 1;
+                inicio = anterior;
+                cpuInicio = cpu;
+            }
+            ultimo = t;
+        } else if (enRacha) {
+            enRacha = 0;
+            r->ticks++;
+            sumaMs += (ultimo - inicio) * 1e3;
+            sumaCpu += cpu - cpuInicio;
+            if ((ultimo - inicio) * 1e3 > r->maxMs) {
+                r->maxMs = (ultimo - inicio) * 1e3;
+            }
+        }
+        cpu = c;
+        anterior = t;
+    }
+    if (r->ticks > 0) {
+        r->ms = sumaMs / r->ticks;
+        r->cpuMs = sumaCpu / 1e6 / r->ticks;
+    }
+}
+
+// Función para arrancar watchdir sobre la raíz con el registro dado
+pid_t arrancar(const struct Opciones *op, const char *conjunto, const char *raiz, const char *registro) {
+    char copia[1024];
+    snprintf(copia, sizeof(copia), "%s", conjunto);
+    char *args[MAX_ARGUMENTOS];
+    int n = 0, conR = 0;
+    args[n++] = (char *)op->binario;
+    char *guardado;
+    for (char *a = strtok_r(copia, " ", &guardado); a != NULL && n < MAX_ARGUMENTOS - 8; a = strtok_r(NULL, " ", &guardado)) {
+        conR |= strcmp(a, "-R") == 0;
+        args[n++] = a;
+    }
+    if (op->anchura > 0 && !conR) {
+        args[n++] = "-R";
+    }
+    args[n++] = "-n";
+    args[n++] = (char *)op->intervalo;
+    args[n++] = "-l";
+    args[n++] = (char *)registro;
+    args[n++] = (char *)raiz;
+    args[n] = NULL;
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        fprintf(stderr, "ERROR: fork()\n");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        int out = open("/dev/null", O_WRONLY);
+        if (out == -1) {
+            _exit(127);
+        }
+        dup2(out, STDOUT_FILENO);
+        execv(args[0], args);
+        _exit(127);
+    }
+    return pid;
+}
+
+// Función para saber si watchdir sigue vivo
+int vivo(pid_t pid) {
+    siginfo_t info;
+    info.si_pid = 0;
+    return waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == 0;
+}
+
+// Función para aplicar a la entrada i el cambio de una carga y anotar la línea que debe producir
+void aplicarCambio(int raiz, const struct Opciones *op, int carga, const char *conjunto, long i, struct Medida *m) {
+    char nombre[64], nuevo[64], clave[160];
+    nombreEntrada(nombre, sizeof(nombre), op->anchura, 'f', i);
+    int r = 0;
+    switch (carga) {
+    case CARGA_CREACION:
+        nombreEntrada(nuevo, sizeof(nuevo), op->anchura, 'n', i);
+        crearFichero(raiz, nuevo);
+        snprintf(clave, sizeof(clave), "Creation: %s", nuevo);
+        break;
+    case CARGA_RENOMBRADO:
+        nombreEntrada(nuevo, sizeof(nuevo), op->anchura, 'r', i);
+        r = renameat(raiz, nombre, raiz, nuevo);
+        snprintf(clave, sizeof(clave), "UpdateName: %s -> %s", nombre, nuevo);
+        break;
+    case CARGA_TAMANO: {
+        int fd = openat(raiz, nombre, O_WRONLY | O_APPEND);
+        r = fd == -1 || write(fd, "x", 1) != 1;
+        if (fd != -1) {
+            close(fd);
+        }
+        // Con -c watchdir registra el contenido en vez del tamaño
+        char tokens[1024];
+        snprintf(tokens, sizeof(tokens), " %s ", conjunto);
+        snprintf(clave, sizeof(clave), "%s: %s", strstr(tokens, " -c ") != NULL ? "UpdateContent" : "UpdateSize", nombre);
+        break;
+    }
+    case CARGA_BORRADO:
+        r = unlinkat(raiz, nombre, 0);
+        snprintf(clave, sizeof(clave), "Deletion: %s", nombre);
+        break;
+    }
+    if (r != 0) {
+        fprintf(stderr, "ERROR: no se puede aplicar el cambio a '%s'\n", nombre);
+        exit(EXIT_FAILURE);
+    }
+    anadirEsperado(m, clave);
+    m->esperados[m->numEsperados - 1].instante = ahora();
+}
+
+// Función para comparar latencias con qsort()
+int compararDobles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Función para hacer una medida: crear el árbol, arrancar watchdir, esperar a su primer
+// escaneo, medir los escaneos en reposo, aplicar la carga y esperar sus líneas. Devuelve 0 si
+// el registro tiene exactamente las líneas esperadas
+int medir(const struct Opciones *op, long entradas, const char *conjunto, int carga) {
+    char raiz[PATH_MAX], registro[PATH_MAX];
+    snprintf(raiz, sizeof(raiz), "%s/arbol", op->dir);
+    snprintf(registro, sizeof(registro), "%s/watchdir.log", op->dir);
+    int fdRaiz = rellenarArbol(raiz, entradas, op->anchura);
+    long cambios = op->cambios < entradas ? op->cambios : entradas;
+    double intervalo = atof(op->intervalo);
+
+    struct Medida m;
+    memset(&m, 0, sizeof(m));
+    m.esperados = malloc(cambios * sizeof(struct Esperado));
+    for (m.tamTabla = 16; m.tamTabla < 2 * cambios; m.tamTabla *= 2) {
+    }
+    m.tabla = malloc(m.tamTabla * sizeof(int));
+    if (m.esperados == NULL || m.tabla == NULL) {
+        fprintf(stderr, "ERROR: malloc()\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(m.tabla, -1, m.tamTabla * sizeof(int));
+    m.fdRegistro = open(registro, O_RDONLY | O_CREAT | O_TRUNC, 0644);
+    if (m.fdRegistro == -1) {
+        fprintf(stderr, "ERROR: no se puede crear '%s'\n", registro);
+        exit(EXIT_FAILURE);
+    }
+
+    // Primer escaneo: se crean centinelas en la raíz hasta que watchdir registra alguno, lo
+    // que solo pasa con los creados después de su primera instantánea
+    double t0 = ahora();
+    pid_t pid = arrancar(op, conjunto, raiz, registro);
+    int numCentinelas = 0;
+    double siguiente = 0;
+    while (!m.listo) {
+        if (!vivo(pid)) {
+            fprintf(stderr, "ERROR: watchdir ha terminado antes de su primer escaneo\n");
+            exit(EXIT_FAILURE);
+        }
+        if (ahora() - t0 > MAX_ARRANQUE) {
+            fprintf(stderr, "ERROR: watchdir no ha terminado su primer escaneo en %d segundos\n", MAX_ARRANQUE);
+            kill(pid, SIGKILL);
+            exit(EXIT_FAILURE);
+        }
+        if (ahora() >= siguiente) {
+            char nombre[32];
+            snprintf(nombre, sizeof(nombre), "centinela%d", numCentinelas++);
+            crearFichero(fdRaiz, nombre);
+            siguiente = ahora() + 2 * intervalo + 0.1;
+        }
+        dormir();
+        leerRegistro(&m);
+    }
+    double arranque = ahora() - t0;
+
+    struct Escaneos escaneos;
+    medirReposo(pid, op->reposo, &escaneos);
+    leerRegistro(&m);
+
+    // Carga: los cambios se reparten por todo el árbol y el registro se lee después de cada
+    // uno, para que la latencia no dependa de lo que dure la carga
+    m.cargando = 1;
+    double inicioCarga = ahora();
+    for (long j = 0; j < cambios; j++) {
+        aplicarCambio(fdRaiz, op, carga, conjunto, j * (entradas / cambios), &m);
+        leerRegistro(&m);
+    }
+    double finCarga = ahora();
+
+    // Esperar a las líneas que faltan mientras sigan llegando, contando con que la espera
+    // adaptativa de watchdir puede haber llegado a su máximo durante el reposo. Después se
+    // espera un poco más por si sobran
+    double limite = 2 * FACTOR_ESPERA * intervalo + 5;
+    while (m.recibidos < m.numEsperados &&
+           ahora() - (m.ultimaLlegada > finCarga ? m.ultimaLlegada : finCarga) < limite && vivo(pid)) {
+        dormir();
+        leerRegistro(&m);
+    }
+    for (double fin = ahora() + 2 * intervalo + 0.1; ahora() < fin;) {
+        dormir();
+        leerRegistro(&m);
+    }
+
+    kill(pid, SIGTERM);
+    int estado;
+    struct rusage uso;
+    while (wait4(pid, &estado, 0, &uso) == -1 && errno == EINTR) {
+    }
+    leerRegistro(&m);
+
+    double *latencias = malloc((m.recibidos + 1) * sizeof(double));
+    double suma = 0;
+    int n = 0, faltan = 0;
+    for (int j = 0; j < m.numEsperados; j++) {
+        if (m.esperados[j].llegada != 0) {
+            latencias[n] = (m.esperados[j].llegada - m.esperados[j].instante) * 1e3;
+            suma += latencias[n++];
+        } else if (faltan++ < MAX_MOSTRADOS) {
+            fprintf(stderr, "falta: %s\n", m.esperados[j].clave);
+        }
+    }
+    qsort(latencias, n, sizeof(double), compararDobles);
+
+    printf("{\"entradas\":%ld,\"anchura\":%ld,\"opciones\":\"%s\",\"carga\":\"%s\",\"cambios\":%ld"
+           ",\"arranque_s\":%.3f,\"ticks\":%d,\"tick_ms\":%.3f,\"tick_cpu_ms\":%.3f,\"tick_max_ms\":%.3f"
+           ",\"carga_s\":%.3f,\"latencia_media_ms\":%.3f,\"latencia_p50_ms\":%.3f,\"latencia_p99_ms\":%.3f"
+           ",\"latencia_max_ms\":%.3f,\"iniciales\":%ld,\"recibidos\":%d,\"faltan\":%d,\"sobran\":%d"
+           ",\"usuario\":%.6f,\"sistema\":%.6f,\"rss_kb\":%ld,\"estado\":%d}\n",
+           entradas, op->anchura, conjunto, nombresCarga[carga], cambios, arranque, escaneos.ticks, escaneos.ms,
+           escaneos.cpuMs, escaneos.maxMs, finCarga - inicioCarga, n > 0 ? suma / n : 0.0,
+           n > 0 ? latencias[n / 2] : 0.0, n > 0 ? latencias[(int)(n * 0.99)] : 0.0, n > 0 ? latencias[n - 1] : 0.0,
+           m.iniciales, m.recibidos, faltan, m.sobran, uso.ru_utime.tv_sec + uso.ru_utime.tv_usec / 1e6,
+           uso.ru_stime.tv_sec + uso.ru_stime.tv_usec / 1e6, uso.ru_maxrss,
+           WIFEXITED(estado) ? WEXITSTATUS(estado) : 128 + WTERMSIG(estado));
+    fflush(stdout);
+
+    free(latencias);
+    for (int j = 0; j < m.numEsperados; j++) {
+        free(m.esperados[j].clave);
+    }
+    free(m.esperados);
+    free(m.tabla);
+    close(m.fdRegistro);
+    close(fdRaiz);
+    return m.iniciales != entradas || faltan > 0 || m.sobran > 0;
+}
+
+// Función principal del programa
+int main(int argc, char *argv[]) {
+    struct Opciones op;
+    memset(&op, 0, sizeof(op));
+    op.dir = DEFAULT_DIR;
+    op.binario = DEFAULT_BINARIO;
+    op.entradas = DEFAULT_ENTRADAS;
+    op.opciones = DEFAULT_OPCIONES;
+    op.cargas = DEFAULT_CARGAS;
+    op.cambios = DEFAULT_CAMBIOS;
+    op.intervalo = DEFAULT_INTERVALO;
+    op.reposo = DEFAULT_REPOSO;
+
+    procesarArgumentos(argc, argv, &op);
+    if (access(op.binario, X_OK) != 0) {
+        fprintf(stderr, "ERROR: no se puede ejecutar '%s'\n", op.binario);
+        exit(EXIT_FAILURE);
+    }
+    if (mkdir(op.dir, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "ERROR: no se puede crear '%s'\n", op.dir);
+        exit(EXIT_FAILURE);
+    }
+    struct statfs fs;
+    if (statfs(op.dir, &fs) == 0 && fs.f_type != TMPFS_MAGIC) {
+        fprintf(stderr, "AVISO: '%s' no está en tmpfs; las medidas incluyen el disco\n", op.dir);
+    }
+
+    // Matriz entradas x opciones x cargas. Las listas se separan por comas y un conjunto de
+    // opciones vacío es válido
+    int errores = 0;
+    char *entradas = strdup(op.entradas);
+    char *resto_e = entradas, *tamano;
+    while ((tamano = strsep(&resto_e, ",")) != NULL) {
+        if (*tamano == '\0') {
+            continue;
+        }
+        long n = atol(tamano);
+        if (n < 1) {
+            fprintf(stderr, "ERROR: '%s' no es un número de entradas válido\n", tamano);
+            exit(EXIT_FAILURE);
+        }
+        char *opciones = strdup(op.opciones);
+        char *resto_o = opciones, *conjunto;
+        while ((conjunto = strsep(&resto_o, ",")) != NULL) {
+            char *cargas = strdup(op.cargas);
+            char *resto_c = cargas, *carga;
+            while ((carga = strsep(&resto_c, ",")) != NULL) {
+                int c = 0;
+                while (c < NCARGAS && strcmp(carga, nombresCarga[c]) != 0) {
+                    c++;
+                }
+                if (c == NCARGAS) {
+                    fprintf(stderr, "ERROR: carga '%s' desconocida\n", carga);
+                    exit(EXIT_FAILURE);
+                }
+                errores += medir(&op, n, conjunto, c);
+            }
+            free(cargas);
+        }
+        free(opciones);
+    }
+    free(entradas);
+
+    char raiz[PATH_MAX];
+    snprintf(raiz, sizeof(raiz), "%s/arbol", op.dir);
+    nftw(raiz, quitar, 64, FTW_DEPTH | FTW_PHYS);
+    if (errores > 0) {
+        fprintf(stderr, "ERROR: %d medidas no registran exactamente los cambios aplicados\n", errores);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -1,17 +1,27 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <signal.h>
-#include <sys/time.h>
 #include <errno.h>
 #include <time.h>
 #include <limits.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <pthread.h>
 
 // Definición del tamaño máximo de una ruta si no está definido
 #ifndef PATH_MAX
@@ -20,170 +30,1933 @@
 #define DEFAULT_DIR "."
 #define DEFAULT_PATH "/tmp/watchdir.log"
 #define DEFAULT_INTERVAL 1
+#define MIN_INTERVAL 0.01
+#define MAX_INTERVAL 60
+#define TAM_DENTS 262144            // Buffer de getdents64() al leer un directorio
+#define UMBRAL_PARALELO 512         // Entradas a partir de las cuales los stat se reparten entre hilos
+#define TRAMO_STAT 64               // Entradas que coge cada hilo de stat de una vez
+#define TRAMO_HASH 4                // Entradas que coge cada hilo al calcular hashes
+#define TAM_BLOQUE_HASH 262144      // Bloque de lectura al calcular el hash de un fichero
+#define MAX_HILOS_STAT 64
+#define TAM_ANILLO (1 << 20)        // Anillo de líneas del registro pendientes de escribir
+#define ESPERA_LOTE_MS 5            // Espera del hilo escritor para juntar más líneas en un writev()
+#define ROTACIONES 5                // Registros rotados que se conservan (LOG.1 ... LOG.5)
+#define MAGIA_INSTANTANEA "WATCHDIR"  // Cabecera del fichero de instantánea (-s)
+#define VERSION_INSTANTANEA 2
+#define FACTOR_ESPERA_MAX 8         // Sin cambios, la espera se dobla hasta 8 veces el intervalo
 #define DEFAULT_CLEAN 0
+#define TAM_EVENTOS 65536           // Buffer de lectura de eventos de inotify
+#define ESPERA_RENOMBRADO_MS 10     // Espera por el IN_MOVED_TO de un IN_MOVED_FROM
+#define ESPERA_GUARDADO_MS 1000     // Calma tras la que se guarda la instantánea con inotify
+#define ESPERA_CONTENIDO_MS 250     // Con -c e inotify, un fichero modificado se relee como mucho una vez cada tanto
+#define MAX_PENDIENTES 64           // Ficheros modificados pendientes de releer con -c e inotify
 
 // Declaración de variables globales
 char *NombreRegistro = DEFAULT_PATH;    // Nombre del archivo de registro
 char *dirNombre = DEFAULT_DIR;         // Directorio por defecto es el directorio actual
-int intervalo = DEFAULT_INTERVAL;     // Intervalo de actualización predeterminado es 1 segundo
+double intervalo = DEFAULT_INTERVAL;  // Intervalo de actualización en segundos, predeterminado 1 segundo
 int descriptor;                      // Descriptor de archivo del archivo de registro
 int limpio = DEFAULT_CLEAN;         // Indicador de si el archivo de registro ha sido limpiado
+int usarInotify = 1;               // Usar inotify en vez de releer el directorio cada intervalo
+int fdDirectorio = -1;            // Descriptor del directorio vigilado
+int fdTemporizador = -1;         // timerfd que vence cada vez que toca releer
+int fdAviso = -1;               // eventfd con el que el bucle principal pide lecturas o el final al hilo lector
+int terminando = 0;             // El bucle principal ha pedido al hilo lector que termine
+int hilosStat = 0;             // Hilos extra para los stat de los directorios grandes (-j)
+int hayStatx = 1;             // Se pone a 0 si el núcleo no tiene statx()
+char *ficheroInstantanea = NULL;  // Fichero donde se guarda la instantánea entre ejecuciones (-s)
+int formatoJson = 0;             // Registrar en JSON, una línea por cambio (-F json)
+off_t rotarBytes = 0;           // Rotar el registro al pasar de este tamaño (-m), 0 si no
+int rotarSegundos = 0;         // Rotar el registro con esta antigüedad (-a), 0 si no
+int contenido = 0;           // Detectar cambios de contenido con un hash de cada fichero (-c)
+int politicaFsync = -1;       // fsync del registro (-y): -1 nunca, 0 tras cada escritura, N cada N segundos
 
-// Estructura para almacenar información sobre un archivo
+// Estructura para almacenar información sobre un archivo. El nombre se guarda en la arena de
+// nombres de su instantánea. Los campos son de tamaño fijo porque el vector de entradas se
+// escribe tal cual en el fichero de instantánea
 struct FileInfo {
-    dev_t dev;       // Identificador de dispositivo
-    ino_t ino;      // Número de inodo
-    char nombre[256];  // Nombre del archivo
-    time_t mtime; // Tiempo de modificación
-    off_t size;  // Tamaño del archivo
+    uint64_t dev;      // Identificador de dispositivo
+    uint64_t ino;     // Número de inodo
+    uint64_t nombre; // Desplazamiento del nombre en la arena
+    int64_t mtime;  // Tiempo de modificación
+    int64_t size;  // Tamaño del archivo
+    int64_t ctime;     // Tiempo de cambio de estado, solo con -c
+    uint64_t hash;     // Hash del contenido de los ficheros regulares, solo con -c
+    uint32_t mode; // Tipo y permisos
+    uint16_t borrada;  // Hueco de una entrada quitada
+    uint16_t sinHash;  // Hay que leer el fichero para calcular su hash
+    uint32_t mtimeNsec;
+    uint32_t ctimeNsec;
 };
 
+#define TABLA_VACIA (-1)
+#define TABLA_BORRADA (-2)
+
+// Instantánea de un directorio: las entradas y sus nombres van en dos vectores contiguos que se
+// reutilizan de una lectura a otra, con dos tablas hash de direccionamiento abierto que guardan
+// índices de entradas, una por (dev, ino) y otra por nombre
+struct Instantanea {
+    struct FileInfo *entradas;
+    int numEntradas;        // Incluidos los huecos
+    int vivas;
+    int capacidad;
+    char *nombres;          // Arena de nombres terminados en '\0'
+    size_t usado;
+    size_t capacidadNombres;
+    int32_t *porInodo;
+    int32_t *porNombre;
+    size_t tamTabla;        // Potencia de dos
+    size_t ocupadas;        // Casillas no vacías, contando las borradas
+    unsigned char *vistos;  // Entradas emparejadas con la otra instantánea al compararlas
+    int capacidadVistos;
+    int prestada;           // Los vectores están en la proyección del fichero de instantánea
+};
+
+// Última instantánea del directorio y la que se rellena en cada lectura
+struct Instantanea actual;
+struct Instantanea siguiente;
+
+// Directorio del árbol vigilado con -R, con su propia instantánea
+struct Directorio {
+    char *ruta;                 // Relativa a la raíz y terminada en '/' ("" para la raíz)
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;      // Del propio directorio en la última lectura de sus entradas
+    struct timespec ctime;
+    int releer;                 // Volver a leer sus entradas aunque no cambien mtime ni ctime
+    struct Instantanea actual;
+    struct Instantanea siguiente;
+};
+
+// Directorios del árbol ordenados por ruta
+struct Directorio *directorios = NULL;
+int numDirectorios = 0;
+int recursivo = 0;
+
 // Función para imprimir el mensaje de uso del programa y finalizar el programa 
 void printUso(int exit_code) {
-    fprintf(stderr, "Usage: ./watchdir [-n SECONDS] [-l LOG] [DIR]\n"
-                    "\tSECONDS Refresh rate in [1..60] seconds [default: 1].\n"
-                    "\tLOG     Log file.\n"
-                    "\tDIR     Directory name [default: '.'].\n\n");
+    fprintf(stderr, "Usage: ./watchdir [-p] [-R] [-c] [-j THREADS] [-n SECONDS] [-l LOG] [-F FORMAT] [-m BYTES]\n"
+                    "                  [-a SECONDS] [-y SYNC] [-s SNAPSHOT] [DIR]\n"
+                    "\t-p          Rescan every SECONDS instead of using inotify.\n"
+                    "\t-R          Watch the whole tree under DIR, rescanning every SECONDS (implies -p).\n"
+                    "\t-c          Log UpdateContent when the contents of a file change, instead of\n"
+                    "\t            UpdateSize and UpdateMtim. Files are only read when their metadata change;\n"
+                    "\t            with inotify, at most every 250 ms while they are being written.\n"
+                    "\t-j THREADS  Extra threads that stat the entries of directories with at least 512\n"
+                    "\t            entries when rescanning, in [0..64] [default: 0].\n"
+                    "\t-n SECONDS  Refresh rate in [0.01..60] seconds when rescanning, doubled up to 8 times\n"
+                    "\t            while nothing changes [default: 1].\n"
+                    "\t-l LOG      Log file.\n"
+                    "\t-F FORMAT   Log format: 'text' or 'json' (one JSON object per line) [default: text].\n"
+                    "\t-m BYTES    Rotate the log to LOG.1 .. LOG.5 when it reaches BYTES (K, M and G suffixes).\n"
+                    "\t-a SECONDS  Rotate the log when it is SECONDS old. With rotation, SIGUSR1 rotates too.\n"
+                    "\t-y SYNC     fsync the log: 'none', 'always' or every SYNC seconds [default: none].\n"
+                    "\t-s SNAPSHOT File that keeps the last snapshot, so that a restart logs what\n"
+                    "\t            changed while watchdir was not running.\n"
+                    "\tDIR         Directory name [default: '.'].\n\n");
     exit(exit_code);
 }
 
-// Función de comparación para ordenar la estructura FileInfo por nombre de archivo
-int compararFileInfo(const void *a, const void *b) {
-    struct FileInfo *fileA = (struct FileInfo *)a;
-    struct FileInfo *fileB = (struct FileInfo *)b;
-    return strncmp(fileA->nombre, fileB->nombre, 256);
+// Función para formatear el tiempo en el formato específico en el buffer dado
+char *formatTime(time_t mtime, char buffer[20]) {
+    strftime(buffer, 20, "%Y-%m-%d %H:%M:%S", localtime(&mtime));
+    return buffer;
 }
 
-// Función para formatear el tiempo en el formato específico
-char *formatTime(time_t mtime) {
-    static char buffer[20];
-    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", localtime(&mtime));
-    return buffer;
+// Tipos de línea del registro
+#define EVENTO_CREACION 0
+#define EVENTO_BORRADO 1
+#define EVENTO_NOMBRE 2
+#define EVENTO_TAMANO 3
+#define EVENTO_MTIME 4
+#define EVENTO_CONTENIDO 5
+
+// Anillo de bytes con las líneas del registro pendientes de escribir. Lo llenan los hilos que
+// detectan cambios y lo vacía el hilo escritor con writev(); si se llena, quien registra espera
+// a que haya hueco en vez de perder líneas
+struct Registro {
+    char datos[TAM_ANILLO];
+    size_t inicio;
+    size_t ocupado;
+    int fin;                    // Escribir lo pendiente y terminar
+    int limpiar;                // SIGUSR1 pendiente
+    pthread_mutex_t mutex;
+    pthread_cond_t hayDatos;
+    pthread_cond_t hayHueco;
+    pthread_t escritor;
+    int arrancado;
+    // Solo los toca el hilo escritor
+    off_t tamano;               // Bytes escritos en el fichero actual
+    time_t abierto;             // Cuándo se empezó el fichero actual
+    time_t ultimoFsync;
+    int sucio;                  // Hay escrituras sin fsync
+};
+
+struct Registro registro = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+                            .hayDatos = PTHREAD_COND_INITIALIZER,
+                            .hayHueco = PTHREAD_COND_INITIALIZER};
+
+// Función para copiar una línea al anillo
+static void encolar(const char *linea, size_t n) {
+    pthread_mutex_lock(&registro.mutex);
+    while (TAM_ANILLO - registro.ocupado < n) {
+        pthread_cond_wait(&registro.hayHueco, &registro.mutex);
+    }
+    size_t pos = (registro.inicio + registro.ocupado) % TAM_ANILLO;
+    size_t primero = n < TAM_ANILLO - pos ? n : TAM_ANILLO - pos;
+    memcpy(registro.datos + pos, linea, primero);
+    memcpy(registro.datos, linea + primero, n - primero);
+    // Se avisa al escritor al empezar un lote y cuando el anillo pasa de la mitad
+    if (registro.ocupado == 0 || (registro.ocupado < TAM_ANILLO / 2 && registro.ocupado + n >= TAM_ANILLO / 2)) {
+        pthread_cond_signal(&registro.hayDatos);
+    }
+    registro.ocupado += n;
+    pthread_mutex_unlock(&registro.mutex);
+}
+
+// Función para escribir ruta y nombre como cadena JSON, con comillas. Devuelve el número de
+// bytes escritos
+static size_t cadenaJson(char *dst, const char *ruta, const char *nombre) {
+    char *p = dst;
+    *p++ = '"';
+    for (int k = 0; k < 2; k++) {
+        for (const unsigned char *c = (const unsigned char *)(k == 0 ? ruta : nombre); *c; c++) {
+            if (*c == '"' || *c == '\\') {
+                *p++ = '\\';
+                *p++ = *c;
+            } else if (*c < 0x20) {
+                p += sprintf(p, "\\u%04x", *c);
+            } else {
+                *p++ = *c;
+            }
+        }
+    }
+    *p++ = '"';
+    return p - dst;
+}
+
+// Función para registrar un cambio. nombre va detrás de ruta, la del directorio relativa a la
+// raíz; nuevo es el nombre nuevo de un renombrado y antes y despues los valores de un cambio de
+// tamaño o de fecha
+void registrar(int tipo, const char *ruta, const char *nombre, const char *nuevo, int64_t antes, int64_t despues) {
+    static const char *nombres[] = {"Creation", "Deletion", "UpdateName", "UpdateSize", "UpdateMtim", "UpdateContent"};
+    char linea[16 * PATH_MAX];  // Cabe el peor caso de JSON, con cada byte escapado
+    char fechaAntes[20], fechaDespues[20];
+    size_t n;
+    if (formatoJson) {
+        n = sprintf(linea, "{\"time\":%lld,\"event\":\"%s\",\"path\":", (long long)time(NULL), nombres[tipo]);
+        n += cadenaJson(linea + n, ruta, nombre);
+        if (tipo == EVENTO_NOMBRE) {
+            n += sprintf(linea + n, ",\"to\":");
+            n += cadenaJson(linea + n, ruta, nuevo);
+        } else if (tipo == EVENTO_TAMANO || tipo == EVENTO_MTIME) {
+            n += sprintf(linea + n, ",\"old\":%lld,\"new\":%lld", (long long)antes, (long long)despues);
+        } else if (tipo == EVENTO_CONTENIDO) {
+            n += sprintf(linea + n, ",\"old\":\"%016llx\",\"new\":\"%016llx\"", (unsigned long long)antes, (unsigned long long)despues);
+        }
+        n += sprintf(linea + n, "}\n");
+    } else if (tipo == EVENTO_NOMBRE) {
+        n = snprintf(linea, sizeof(linea), "UpdateName: %s%s -> %s%s\n", ruta, nombre, ruta, nuevo);
+    } else if (tipo == EVENTO_TAMANO) {
+        n = snprintf(linea, sizeof(linea), "UpdateSize: %s%s: %lld -> %lld\n", ruta, nombre, (long long)antes, (long long)despues);
+    } else if (tipo == EVENTO_CONTENIDO) {
+        n = snprintf(linea, sizeof(linea), "UpdateContent: %s%s: %016llx -> %016llx\n", ruta, nombre,
+                     (unsigned long long)antes, (unsigned long long)despues);
+    } else if (tipo == EVENTO_MTIME) {
+        n = snprintf(linea, sizeof(linea), "UpdateMtim: %s%s: %s -> %s\n", ruta, nombre,
+                     formatTime(antes, fechaAntes), formatTime(despues, fechaDespues));
+    } else {
+        n = snprintf(linea, sizeof(linea), "%s: %s%s\n", nombres[tipo], ruta, nombre);
+    }
+    encolar(linea, n < sizeof(linea) ? n : sizeof(linea) - 1);
+}
+
+// Función para pasar el registro actual a NombreRegistro.1, desplazando los anteriores hasta
+// NombreRegistro.ROTACIONES, y empezar uno nuevo. Lo que ya se escribió queda en el viejo y lo
+// pendiente va al nuevo, así que no se pierde nada
+static void rotarRegistro(void) {
+    registro.abierto = time(NULL);
+    if (registro.tamano == 0) {
+        return; // Nada que rotar
+    }
+    char viejo[PATH_MAX], nuevo[PATH_MAX];
+    for (int k = ROTACIONES; k > 1; k--) {
+        snprintf(viejo, sizeof(viejo), "%s.%d", NombreRegistro, k - 1);
+        snprintf(nuevo, sizeof(nuevo), "%s.%d", NombreRegistro, k);
+        rename(viejo, nuevo);
+    }
+    snprintf(nuevo, sizeof(nuevo), "%s.1", NombreRegistro);
+    if (registro.sucio && politicaFsync >= 0) {
+        fdatasync(descriptor);
+    }
+    if (rename(NombreRegistro, nuevo) != 0) {
+        fprintf(stderr, "WARNING: Cannot rotate log file.\n");
+        return;
+    }
+    int fd = open(NombreRegistro, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        fprintf(stderr, "WARNING: Cannot open log file, still writing to '%s'.\n", nuevo);
+        return;
+    }
+    dup2(fd, descriptor);
+    close(fd);
+    registro.tamano = 0;
+    registro.sucio = 0;
+}
+
+// Función para atender SIGUSR1: con rotación, rota el registro; si no, lo vacía la primera vez
+static void limpiarRegistro(void) {
+    if (rotarBytes > 0 || rotarSegundos > 0) {
+        rotarRegistro();
+        return;
+    }
+    if (limpio) {
+        return;
+    }
+    if (ftruncate(descriptor, 0) != 0 || lseek(descriptor, 0, SEEK_SET) == -1) {
+        perror("ERROR: Cannot open log file");
+        return;
+    }
+    registro.tamano = 0;
+    limpio = 1;
 }
 
-// Función para actualizar el archivo de registro con los cambios en el directorio
-void actualizarArchivo(const struct FileInfo *oldEntrada, int oldContador, const struct FileInfo *newEntrada, int newContador) {
-    int oldIndex = 0;
-    int newIndex = 0;
-    while (oldIndex < oldContador && newIndex < newContador) {
-        if (oldEntrada[oldIndex].nombre[0] == '.' || newEntrada[newIndex].nombre[0] == '.') {
-            if (oldEntrada[oldIndex].nombre[0] == '.') {
-                oldIndex++;
+// Función para escribir un tramo del anillo en el fichero, repitiendo las escrituras parciales
+static void escribirTramo(size_t inicio, size_t n) {
+    while (n > 0) {
+        struct iovec iov[2];
+        size_t primero = n < TAM_ANILLO - inicio ? n : TAM_ANILLO - inicio;
+        iov[0].iov_base = registro.datos + inicio;
+        iov[0].iov_len = primero;
+        iov[1].iov_base = registro.datos;
+        iov[1].iov_len = n - primero;
+        ssize_t escrito = writev(descriptor, iov, n > primero ? 2 : 1);
+        if (escrito == -1) {
+            if (errno == EINTR) {
+                continue;
             }
-            if (newEntrada[newIndex].nombre[0] == '.') {
-                newIndex++;
+            fprintf(stderr, "ERROR: write()\n");
+            exit(EXIT_FAILURE);
+        }
+        inicio = (inicio + escrito) % TAM_ANILLO;
+        n -= escrito;
+        registro.tamano += escrito;
+    }
+}
+
+// Función del hilo escritor. Cuando empieza un lote espera ESPERA_LOTE_MS, o hasta que el anillo
+// pase de la mitad, y lo vacía de una vez con writev(), de modo que una ráfaga de cambios se
+// escribe en pocas llamadas; rota el registro por tamaño o por antigüedad entre escrituras y
+// hace fsync según politicaFsync
+void *hiloEscritor(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&registro.mutex);
+    while (1) {
+        if (registro.ocupado > 0 && registro.ocupado < TAM_ANILLO / 2 && !registro.fin && !registro.limpiar) {
+            struct timespec hasta;
+            clock_gettime(CLOCK_REALTIME, &hasta);
+            hasta.tv_nsec += ESPERA_LOTE_MS * 1000000L;
+            if (hasta.tv_nsec >= 1000000000L) {
+                hasta.tv_sec++;
+                hasta.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&registro.hayDatos, &registro.mutex, &hasta);
+        }
+        time_t ahora = time(NULL);
+        time_t plazo = 0;  // Próximo fsync o rotación pendientes de hora
+        if (registro.sucio && politicaFsync > 0) {
+            plazo = registro.ultimoFsync + politicaFsync;
+        }
+        if (rotarSegundos > 0 && (plazo == 0 || registro.abierto + rotarSegundos < plazo)) {
+            plazo = registro.abierto + rotarSegundos;
+        }
+        if (registro.ocupado == 0 && !registro.fin && !registro.limpiar && (plazo == 0 || plazo > ahora)) {
+            if (plazo == 0) {
+                pthread_cond_wait(&registro.hayDatos, &registro.mutex);
+            } else {
+                struct timespec hasta = {plazo, 0};
+                pthread_cond_timedwait(&registro.hayDatos, &registro.mutex, &hasta);
             }
             continue;
         }
 
-        if (oldEntrada[oldIndex].ino == newEntrada[newIndex].ino &&
-            oldEntrada[oldIndex].dev == newEntrada[newIndex].dev) {
+        size_t inicio = registro.inicio;
+        size_t n = registro.ocupado;
+        int limpiar = registro.limpiar;
+        int fin = registro.fin;
+        registro.limpiar = 0;
+        pthread_mutex_unlock(&registro.mutex);
 
-            if (strncmp(oldEntrada[oldIndex].nombre, newEntrada[newIndex].nombre, 256) != 0) {
-                dprintf(descriptor, "UpdateName: %s -> %s\n", oldEntrada[oldIndex].nombre, newEntrada[newIndex].nombre);
-            } else if (oldEntrada[oldIndex].size != newEntrada[newIndex].size) {
-                dprintf(descriptor, "UpdateSize: %s: %ld -> %ld\n", newEntrada[newIndex].nombre, (long)oldEntrada[oldIndex].size, (long)newEntrada[newIndex].size);
-            } else if (oldEntrada[oldIndex].mtime != newEntrada[newIndex].mtime) {
-                dprintf(descriptor, "UpdateMtim: %s: %s -> %s\n", newEntrada[newIndex].nombre, formatTime(oldEntrada[oldIndex].mtime), formatTime(newEntrada[newIndex].mtime));
+        if (n > 0) {
+            escribirTramo(inicio, n);
+            registro.sucio = 1;
+        }
+        ahora = time(NULL);
+        if (registro.sucio && (politicaFsync == 0 || (politicaFsync > 0 && ahora >= registro.ultimoFsync + politicaFsync) || fin)) {
+            if (politicaFsync >= 0) {
+                fdatasync(descriptor);
+            }
+            registro.ultimoFsync = ahora;
+            registro.sucio = 0;
+        }
+        if (limpiar) {
+            limpiarRegistro();
+        } else if ((rotarBytes > 0 && registro.tamano >= rotarBytes) ||
+                   (rotarSegundos > 0 && ahora >= registro.abierto + rotarSegundos)) {
+            rotarRegistro();
+        }
+
+        pthread_mutex_lock(&registro.mutex);
+        registro.inicio = (inicio + n) % TAM_ANILLO;
+        registro.ocupado -= n;
+        pthread_cond_broadcast(&registro.hayHueco);
+        if (fin && registro.ocupado == 0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&registro.mutex);
+    return NULL;
+}
+
+// Función para pedir al hilo escritor que atienda SIGUSR1 después de lo ya registrado
+void pedirLimpieza(void) {
+    pthread_mutex_lock(&registro.mutex);
+    registro.limpiar = 1;
+    pthread_cond_signal(&registro.hayDatos);
+    pthread_mutex_unlock(&registro.mutex);
+}
+
+// Función para escribir lo pendiente y parar el hilo escritor. Se llama al salir
+void cerrarRegistro(void) {
+    if (!registro.arrancado || pthread_equal(pthread_self(), registro.escritor)) {
+        return;
+    }
+    pthread_mutex_lock(&registro.mutex);
+    registro.fin = 1;
+    pthread_cond_signal(&registro.hayDatos);
+    pthread_mutex_unlock(&registro.mutex);
+    pthread_join(registro.escritor, NULL);
+    registro.arrancado = 0;
+    close(descriptor);
+}
+
+// Función para arrancar el hilo escritor sobre el registro ya abierto
+void iniciarRegistro(void) {
+    registro.abierto = time(NULL);
+    registro.ultimoFsync = registro.abierto;
+    if (pthread_create(&registro.escritor, NULL, hiloEscritor, NULL) != 0) {
+        fprintf(stderr, "ERROR: pthread_create()\n");
+        exit(EXIT_FAILURE);
+    }
+    registro.arrancado = 1;
+    atexit(cerrarRegistro);
+}
+
+// Función para obtener el nombre de una entrada de la instantánea
+static inline const char *nombreDe(const struct Instantanea *s, const struct FileInfo *e) {
+    return s->nombres + e->nombre;
+}
+
+// Función hash para (dev, ino)
+static inline size_t hashInodo(dev_t dev, ino_t ino) {
+    uint64_t h = ((uint64_t)ino ^ ((uint64_t)dev << 32 | (uint64_t)dev >> 32)) * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h ^ (h >> 29));
+}
+
+// Función hash para nombres (FNV-1a)
+static inline size_t hashNombre(const char *nombre) {
+    uint64_t h = 0xCBF29CE484222325ULL;
+    for (const unsigned char *p = (const unsigned char *)nombre; *p; p++) {
+        h = (h ^ *p) * 0x100000001B3ULL;
+    }
+    return (size_t)(h ^ (h >> 29));
+}
+
+// Función para dejar vacía una instantánea conservando la memoria reservada. Una instantánea
+// prestada se suelta y empieza de cero
+void vaciarInstantanea(struct Instantanea *s) {
+    if (s->prestada) {
+        unsigned char *vistos = s->vistos;
+        int capacidadVistos = s->capacidadVistos;
+        memset(s, 0, sizeof(*s));
+        s->vistos = vistos;
+        s->capacidadVistos = capacidadVistos;
+    }
+    s->numEntradas = 0;
+    s->vivas = 0;
+    s->usado = 0;
+    s->ocupadas = 0;
+    if (s->tamTabla > 0) {
+        memset(s->porInodo, 0xff, s->tamTabla * sizeof(int32_t));
+        memset(s->porNombre, 0xff, s->tamTabla * sizeof(int32_t));
+    }
+}
+
+// Función para liberar la memoria de una instantánea
+void liberarInstantanea(struct Instantanea *s) {
+    if (!s->prestada) {
+        free(s->entradas);
+        free(s->nombres);
+        free(s->porInodo);
+        free(s->porNombre);
+    }
+    free(s->vistos);
+    memset(s, 0, sizeof(*s));
+}
+
+// Función para enlazar una entrada en las dos tablas hash
+static void enlazarEntrada(struct Instantanea *s, int i) {
+    size_t mascara = s->tamTabla - 1;
+    const struct FileInfo *e = &s->entradas[i];
+    size_t h = hashInodo(e->dev, e->ino) & mascara;
+    while (s->porInodo[h] >= 0) {
+        h = (h + 1) & mascara;
+    }
+    s->porInodo[h] = i;
+    h = hashNombre(nombreDe(s, e)) & mascara;
+    while (s->porNombre[h] >= 0) {
+        h = (h + 1) & mascara;
+    }
+    s->porNombre[h] = i;
+    s->ocupadas++;
+}
+
+// Función para rehacer las tablas hash con sitio para al menos minimo entradas, descartando
+// las casillas borradas
+static void rehacerTablas(struct Instantanea *s, size_t minimo) {
+    size_t tam = 64;
+    while (tam < 2 * minimo) {
+        tam *= 2;
+    }
+    if (tam != s->tamTabla) {
+        free(s->porInodo);
+        free(s->porNombre);
+        s->porInodo = malloc(tam * sizeof(int32_t));
+        s->porNombre = malloc(tam * sizeof(int32_t));
+        if (s->porInodo == NULL || s->porNombre == NULL) {
+            perror("ERROR: malloc()");
+            exit(EXIT_FAILURE);
+        }
+        s->tamTabla = tam;
+    }
+    memset(s->porInodo, 0xff, tam * sizeof(int32_t));
+    memset(s->porNombre, 0xff, tam * sizeof(int32_t));
+    s->ocupadas = 0;
+    for (int i = 0; i < s->numEntradas; i++) {
+        if (!s->entradas[i].borrada) {
+            enlazarEntrada(s, i);
+        }
+    }
+}
+
+// Función para guardar una entrada con los datos de info y el nombre dado al final de los
+// vectores, que crecen al doble cuando se llenan. No la enlaza en las tablas. Devuelve su índice
+int guardarEntrada(struct Instantanea *s, const char *nombre, const struct FileInfo *info) {
+    if (s->numEntradas == s->capacidad) {
+        s->capacidad = s->capacidad == 0 ? 64 : 2 * s->capacidad;
+        struct FileInfo *mas = realloc(s->entradas, s->capacidad * sizeof(struct FileInfo));
+        if (mas == NULL) {
+            perror("ERROR: realloc()");
+            exit(EXIT_FAILURE);
+        }
+        s->entradas = mas;
+    }
+    size_t len = strlen(nombre) + 1;
+    if (s->usado + len > s->capacidadNombres) {
+        size_t cap = s->capacidadNombres == 0 ? 4096 : s->capacidadNombres;
+        while (s->usado + len > cap) {
+            cap *= 2;
+        }
+        char *mas = realloc(s->nombres, cap);
+        if (mas == NULL) {
+            perror("ERROR: realloc()");
+            exit(EXIT_FAILURE);
+        }
+        s->nombres = mas;
+        s->capacidadNombres = cap;
+    }
+    memcpy(s->nombres + s->usado, nombre, len);
+
+    int i = s->numEntradas++;
+    s->entradas[i] = *info;
+    s->entradas[i].nombre = s->usado;
+    s->entradas[i].borrada = 0;
+    s->usado += len;
+    return i;
+}
+
+// Función para añadir una entrada con los datos de info y el nombre dado, enlazada en las
+// tablas. Devuelve su índice
+int anadirEntrada(struct Instantanea *s, const char *nombre, const struct FileInfo *info) {
+    int i = guardarEntrada(s, nombre, info);
+    s->vivas++;
+    // Carga máxima de la mitad, contando las casillas borradas
+    if (2 * (s->ocupadas + 1) > s->tamTabla) {
+        rehacerTablas(s, s->vivas);
+    } else {
+        enlazarEntrada(s, i);
+    }
+    return i;
+}
+
+// Función para buscar la entrada de un inodo que aún no esté en vistos (NULL si da igual). Si
+// hay varias (enlaces duros), se prefiere la que tenga el nombre dado. Devuelve su índice o -1
+int buscarInodo(const struct Instantanea *s, uint64_t dev, uint64_t ino, const char *nombre, const unsigned char *vistos) {
+    if (s->tamTabla == 0) {
+        return -1;
+    }
+    size_t mascara = s->tamTabla - 1;
+    int candidata = -1;
+    for (size_t h = hashInodo(dev, ino) & mascara; s->porInodo[h] != TABLA_VACIA; h = (h + 1) & mascara) {
+        int i = s->porInodo[h];
+        if (i < 0) {
+            continue;
+        }
+        const struct FileInfo *e = &s->entradas[i];
+        if (e->ino == ino && e->dev == dev && (vistos == NULL || !vistos[i])) {
+            if (strcmp(nombreDe(s, e), nombre) == 0) {
+                return i;
+            }
+            if (candidata < 0) {
+                candidata = i;
+            }
+        }
+    }
+    return candidata;
+}
+
+// Función para buscar una entrada por nombre. Devuelve su índice o -1
+int buscarNombre(const struct Instantanea *s, const char *nombre) {
+    if (s->tamTabla == 0) {
+        return -1;
+    }
+    size_t mascara = s->tamTabla - 1;
+    for (size_t h = hashNombre(nombre) & mascara; s->porNombre[h] != TABLA_VACIA; h = (h + 1) & mascara) {
+        int i = s->porNombre[h];
+        if (i >= 0 && strcmp(nombreDe(s, &s->entradas[i]), nombre) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Función para quitar una entrada. Deja un hueco en los vectores y casillas borradas en las
+// tablas; cuando los huecos superan a las entradas vivas se compacta la instantánea
+void quitarEntrada(struct Instantanea *s, int i) {
+    size_t mascara = s->tamTabla - 1;
+    struct FileInfo *e = &s->entradas[i];
+    size_t h = hashInodo(e->dev, e->ino) & mascara;
+    while (s->porInodo[h] != i) {
+        h = (h + 1) & mascara;
+    }
+    s->porInodo[h] = TABLA_BORRADA;
+    h = hashNombre(nombreDe(s, e)) & mascara;
+    while (s->porNombre[h] != i) {
+        h = (h + 1) & mascara;
+    }
+    s->porNombre[h] = TABLA_BORRADA;
+    e->borrada = 1;
+    s->vivas--;
+
+    if (s->numEntradas >= 64 && s->vivas < s->numEntradas / 2) {
+        struct Instantanea compacta;
+        memset(&compacta, 0, sizeof(compacta));
+        for (int k = 0; k < s->numEntradas; k++) {
+            if (!s->entradas[k].borrada) {
+                anadirEntrada(&compacta, nombreDe(s, &s->entradas[k]), &s->entradas[k]);
             }
-            oldIndex++;
-            newIndex++;
-        } else {
-            dprintf(descriptor, "Deletion: %s\n", oldEntrada[oldIndex].nombre);
-            oldIndex++;
         }
+        liberarInstantanea(s);
+        *s = compacta;
     }
+}
+
+// Función para rellenar los datos de una entrada a partir de su stat
+void datosDeStat(const struct stat *fileStat, struct FileInfo *info) {
+    info->dev = fileStat->st_dev;
+    info->ino = fileStat->st_ino;
+    info->mtime = fileStat->st_mtim.tv_sec;
+    info->mtimeNsec = fileStat->st_mtim.tv_nsec;
+    info->ctime = fileStat->st_ctim.tv_sec;
+    info->ctimeNsec = fileStat->st_ctim.tv_nsec;
+    info->size = fileStat->st_size;
+    info->mode = fileStat->st_mode;
+}
 
-    for (int i = newIndex; i < newContador; i++) {
-        if (newEntrada[i].nombre[0] != '.') {
-            dprintf(descriptor, "Creation: %s\n", newEntrada[i].nombre);
+// Función para consultar una entrada relativa al descriptor de su directorio. Con statx() solo se
+// piden los campos que se registran, más el tipo si no se conoce y el ctime con -c, y sin forzar la sincronización
+// con el servidor en sistemas de ficheros de red. flags es 0 o AT_SYMLINK_NOFOLLOW. Devuelve 0
+// si ya no existe
+int consultarEntrada(int dfd, const char *nombre, int flags, int conTipo, struct FileInfo *info) {
+    if (hayStatx) {
+        struct statx stx;
+        unsigned int mascara = STATX_INO | STATX_SIZE | STATX_MTIME | (conTipo ? STATX_TYPE : 0) |
+                               (contenido ? STATX_CTIME : 0);
+        if (statx(dfd, nombre, flags | AT_STATX_DONT_SYNC, mascara, &stx) == 0) {
+            info->dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+            info->ino = stx.stx_ino;
+            info->mtime = stx.stx_mtime.tv_sec;
+            info->mtimeNsec = stx.stx_mtime.tv_nsec;
+            info->ctime = stx.stx_ctime.tv_sec;
+            info->ctimeNsec = stx.stx_ctime.tv_nsec;
+            info->size = stx.stx_size;
+            if (conTipo) {
+                info->mode = stx.stx_mode;
+            }
+            return 1;
         }
+        if (errno != ENOSYS) {
+            return 0;
+        }
+        hayStatx = 0;
+    }
+    struct stat fileStat;
+    if (fstatat(dfd, nombre, &fileStat, flags) != 0) {
+        return 0;
     }
+    mode_t tipo = info->mode;
+    datosDeStat(&fileStat, info);
+    if (!conTipo) {
+        info->mode = tipo;
+    }
+    return 1;
+}
+
+// Función para reservar una entrada con su nombre sin enlazarla en las tablas, porque aún no se
+// conocen sus datos. Queda como hueco hasta que consultarEntradas() los rellena
+void reservarEntrada(struct Instantanea *s, const char *nombre, mode_t tipo) {
+    struct FileInfo info;
+    memset(&info, 0, sizeof(info));
+    info.mode = tipo;
+    int i = guardarEntrada(s, nombre, &info);
+    s->entradas[i].borrada = 1;
+}
+
+// Constantes de XXH64
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+// Estado de XXH64 por partes: cuatro acumuladores que avanzan de 32 en 32 bytes y el resto
+// que aún no completa una franja
+struct Xxh64 {
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char resto[32];
+    size_t numResto;
+};
 
-    for (int i = oldIndex; i < oldContador; i++) {
-        if (oldEntrada[i].nombre[0] != '.') {
-            dprintf(descriptor, "Deletion: %s\n", oldEntrada[i].nombre);
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t leer64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;  // XXH64 se define en little endian, como las máquinas en las que corre esto
+}
+
+static inline uint64_t rondaXxh(uint64_t acc, uint64_t dato) {
+    return rotl64(acc + dato * XXH_P2, 31) * XXH_P1;
+}
+
+// Función para empezar un hash con semilla 0
+static void iniciarXxh(struct Xxh64 *h) {
+    h->v[0] = XXH_P1 + XXH_P2;
+    h->v[1] = XXH_P2;
+    h->v[2] = 0;
+    h->v[3] = -XXH_P1;
+    h->total = 0;
+    h->numResto = 0;
+}
+
+// Función para pasar una franja de 32 bytes por los cuatro acumuladores
+static inline void franjaXxh(struct Xxh64 *h, const unsigned char *p) {
+    h->v[0] = rondaXxh(h->v[0], leer64(p));
+    h->v[1] = rondaXxh(h->v[1], leer64(p + 8));
+    h->v[2] = rondaXxh(h->v[2], leer64(p + 16));
+    h->v[3] = rondaXxh(h->v[3], leer64(p + 24));
+}
+
+// Función para añadir datos al hash
+static void actualizarXxh(struct Xxh64 *h, const unsigned char *p, size_t n) {
+    h->total += n;
+    if (h->numResto > 0) {
+        size_t falta = 32 - h->numResto < n ? 32 - h->numResto : n;
+        memcpy(h->resto + h->numResto, p, falta);
+        h->numResto += falta;
+        p += falta;
+        n -= falta;
+        if (h->numResto < 32) {
+            return;
         }
+        franjaXxh(h, h->resto);
+        h->numResto = 0;
+    }
+    for (; n >= 32; p += 32, n -= 32) {
+        franjaXxh(h, p);
     }
+    memcpy(h->resto, p, n);
+    h->numResto = n;
 }
 
-// Función para manejar señales (SIGALRM y SIGUSR1)
-void manejadorSignal(int signal) {
-    static struct FileInfo *oldEntrada = NULL;
-    static int oldContador = 0;
+// Función para terminar el hash
+static uint64_t finalXxh(const struct Xxh64 *h) {
+    uint64_t r;
+    if (h->total >= 32) {
+        r = rotl64(h->v[0], 1) + rotl64(h->v[1], 7) + rotl64(h->v[2], 12) + rotl64(h->v[3], 18);
+        for (int k = 0; k < 4; k++) {
+            r = (r ^ rondaXxh(0, h->v[k])) * XXH_P1 + XXH_P4;
+        }
+    } else {
+        r = XXH_P5;
+    }
+    r += h->total;
+    const unsigned char *p = h->resto;
+    size_t n = h->numResto;
+    for (; n >= 8; p += 8, n -= 8) {
+        r = rotl64(r ^ rondaXxh(0, leer64(p)), 27) * XXH_P1 + XXH_P4;
+    }
+    if (n >= 4) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        r = rotl64(r ^ (uint64_t)v * XXH_P1, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        n -= 4;
+    }
+    for (; n > 0; p++, n--) {
+        r = rotl64(r ^ *p * XXH_P5, 11) * XXH_P1;
+    }
+    r ^= r >> 33;
+    r *= XXH_P2;
+    r ^= r >> 29;
+    r *= XXH_P3;
+    r ^= r >> 32;
+    return r;
+}
 
-    if (signal == SIGALRM) {
-        DIR *dir = opendir(dirNombre);
-        if (!dir) {
-            // opendir() falló, no hacer nada y simplemente regresar.
-            fprintf(stderr, "ERROR: opendir()\n");
-            exit(EXIT_FAILURE);  // Cambiar exit por return para evitar bloqueo
+// Función para calcular el hash del contenido de un fichero, leyéndolo con pread() en bloques
+// de TAM_BLOQUE_HASH para no proyectar ficheros que otro puede estar truncando. Devuelve 0 si
+// no se puede leer
+uint64_t hashFichero(int dfd, const char *nombre) {
+    static __thread unsigned char bloque[TAM_BLOQUE_HASH];
+    int fd = openat(dfd, nombre, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd == -1) {
+        return 0;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    struct Xxh64 h;
+    iniciarXxh(&h);
+    off_t pos = 0;
+    ssize_t leido;
+    while ((leido = pread(fd, bloque, sizeof(bloque), pos)) != 0) {
+        if (leido == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return 0;
         }
+        actualizarXxh(&h, bloque, leido);
+        pos += leido;
+    }
+    close(fd);
+    return finalXxh(&h);
+}
 
-        struct FileInfo *newFileInfos = NULL;
-        struct dirent *entry;
-        int newCount = 0;
+// Trabajo repartido entre los hilos de stat: las entradas de una instantánea se cogen por
+// tramos con un contador atómico, para consultarlas o para calcular los hashes pendientes
+struct Reparto {
+    int dfd;
+    int flags;
+    int hash;                 // Calcular hashes en vez de consultar entradas
+    struct Instantanea *s;
+    int siguiente;
+    int activos;              // Hilos que aún no han terminado el trabajo actual
+    unsigned generacion;      // Cambia con cada trabajo nuevo
+};
 
-        while ((entry = readdir(dir)) != NULL) {
-            char filePath[PATH_MAX];
-            snprintf(filePath, PATH_MAX, "%s/%s", dirNombre, entry->d_name);
-            struct stat fileStat;
-            if (stat(filePath, &fileStat) == 0) {
-                newFileInfos = realloc(newFileInfos, (newCount + 1) * sizeof(struct FileInfo));
-                if (newFileInfos == NULL) {
-                    perror("ERROR: realloc()");
-                    closedir(dir);
-                    return; // Cambiar exit por return para evitar bloqueo
+struct Reparto reparto;
+pthread_mutex_t mutexReparto = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t hayReparto = PTHREAD_COND_INITIALIZER;
+pthread_cond_t finReparto = PTHREAD_COND_INITIALIZER;
+
+// Función para procesar las entradas del reparto actual hasta que no quede ninguna
+void consultarTramos(void) {
+    struct Instantanea *s = reparto.s;
+    int n = s->numEntradas;
+    int tramo = reparto.hash ? TRAMO_HASH : TRAMO_STAT;
+    int i;
+    while ((i = __atomic_fetch_add(&reparto.siguiente, tramo, __ATOMIC_RELAXED)) < n) {
+        int fin = i + tramo < n ? i + tramo : n;
+        for (; i < fin; i++) {
+            struct FileInfo *e = &s->entradas[i];
+            if (reparto.hash) {
+                if (e->sinHash) {
+                    e->hash = hashFichero(reparto.dfd, s->nombres + e->nombre);
+                    e->sinHash = 0;
                 }
-                newFileInfos[newCount].dev = fileStat.st_dev;
-                newFileInfos[newCount].ino = entry->d_ino;
-                strncpy(newFileInfos[newCount].nombre, entry->d_name, 256);
-                newFileInfos[newCount].mtime = fileStat.st_mtime;
-                newFileInfos[newCount].size = fileStat.st_size;
-                newCount++;
+                continue;
             }
+            // Con un enlace seguido, d_type dice el tipo del enlace y no el de su destino
+            int conTipo = (e->mode & S_IFMT) == 0 || (S_ISLNK(e->mode) && reparto.flags == 0);
+            e->borrada = !consultarEntrada(reparto.dfd, s->nombres + e->nombre, reparto.flags, conTipo, e);
         }
-        closedir(dir);
+    }
+}
+
+// Función de cada hilo de stat: espera un reparto, ayuda a terminarlo y vuelve a esperar
+void *hiloStat(void *arg) {
+    (void)arg;
+    unsigned vista = 0;
+    while (1) {
+        pthread_mutex_lock(&mutexReparto);
+        while (reparto.generacion == vista) {
+            pthread_cond_wait(&hayReparto, &mutexReparto);
+        }
+        vista = reparto.generacion;
+        pthread_mutex_unlock(&mutexReparto);
+
+        consultarTramos();
+
+        pthread_mutex_lock(&mutexReparto);
+        if (--reparto.activos == 0) {
+            pthread_cond_signal(&finReparto);
+        }
+        pthread_mutex_unlock(&mutexReparto);
+    }
+    return NULL;
+}
+
+// Función para arrancar los hilos de stat
+void iniciarHilosStat(void) {
+    for (int i = 0; i < hilosStat; i++) {
+        pthread_t hilo;
+        if (pthread_create(&hilo, NULL, hiloStat, NULL) != 0) {
+            fprintf(stderr, "ERROR: pthread_create()\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(hilo);
+    }
+}
+
+// Función para procesar las entradas de una instantánea, repartiéndolas con los hilos de stat si
+// paralelo. El hilo lector también coge tramos
+static void repartir(int dfd, struct Instantanea *s, int flags, int hash, int paralelo) {
+    reparto.dfd = dfd;
+    reparto.flags = flags;
+    reparto.hash = hash;
+    reparto.s = s;
+    reparto.siguiente = 0;
+    if (hilosStat > 0 && paralelo) {
+        pthread_mutex_lock(&mutexReparto);
+        reparto.activos = hilosStat;
+        reparto.generacion++;
+        pthread_cond_broadcast(&hayReparto);
+        pthread_mutex_unlock(&mutexReparto);
+
+        consultarTramos();
+
+        pthread_mutex_lock(&mutexReparto);
+        while (reparto.activos > 0) {
+            pthread_cond_wait(&finReparto, &mutexReparto);
+        }
+        pthread_mutex_unlock(&mutexReparto);
+    } else {
+        consultarTramos();
+    }
+}
 
-        qsort(newFileInfos, newCount, sizeof(struct FileInfo), compararFileInfo);
+// Función para rellenar los datos de todas las entradas reservadas y enlazarlas en las tablas.
+// En directorios grandes los stat se reparten con los hilos de stat. Las que ya no existen se
+// quedan como huecos
+void consultarEntradas(int dfd, struct Instantanea *s, int flags) {
+    repartir(dfd, s, flags, 0, s->numEntradas >= UMBRAL_PARALELO);
+    s->vivas = 0;
+    for (int i = 0; i < s->numEntradas; i++) {
+        s->vivas += !s->entradas[i].borrada;
+    }
+    rehacerTablas(s, s->vivas);
+}
 
-        actualizarArchivo(oldEntrada, oldContador, newFileInfos, newCount);
+// Función para saber si los metadatos de un fichero no han cambiado, con nanosegundos
+static inline int mismosMetadatos(const struct FileInfo *a, const struct FileInfo *b) {
+    return a->size == b->size && a->mtime == b->mtime && a->mtimeNsec == b->mtimeNsec &&
+           a->ctime == b->ctime && a->ctimeNsec == b->ctimeNsec;
+}
 
-        free(oldEntrada);
-        oldEntrada = newFileInfos;
-        oldContador = newCount;
+// Función para poner los hashes de una instantánea nueva con -c. Los ficheros regulares cuyos
+// metadatos no han cambiado heredan el hash de la vieja sin leerlos; el resto se leen, en
+// paralelo con los hilos de stat si hay más de uno
+void prepararHashes(int dfd, const struct Instantanea *vieja, struct Instantanea *nueva) {
+    int pendientes = 0;
+    for (int i = 0; i < nueva->numEntradas; i++) {
+        struct FileInfo *n = &nueva->entradas[i];
+        n->hash = 0;
+        n->sinHash = 0;
+        if (n->borrada || !S_ISREG(n->mode)) {
+            continue;
+        }
+        int j = buscarInodo(vieja, n->dev, n->ino, nombreDe(nueva, n), NULL);
+        if (j >= 0 && mismosMetadatos(&vieja->entradas[j], n)) {
+            n->hash = vieja->entradas[j].hash;
+        } else {
+            n->sinHash = 1;
+            pendientes++;
+        }
+    }
+    if (pendientes > 0) {
+        repartir(dfd, nueva, 0, 1, pendientes > 1);
+    }
+}
 
-    } else if (signal == SIGUSR1) {
-        if (!limpio) {
-            close(descriptor);
-            descriptor = open(NombreRegistro, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-            if (descriptor == -1) {
-                perror("ERROR: Cannot open log file");
-                return; // Cambiar exit por return para evitar bloqueo
+// Función para leer las entradas de un directorio con getdents64() y reservarlas en la
+// instantánea con el tipo de d_type. Las ocultas no se registran nunca, así que ni se guardan.
+// Devuelve 0 si no se puede leer
+int leerEntradas(int dfd, struct Instantanea *s) {
+    static char dents[TAM_DENTS] __attribute__((aligned(8)));
+    ssize_t bytes;
+    while ((bytes = getdents64(dfd, dents, sizeof(dents))) > 0) {
+        for (ssize_t off = 0; off < bytes;) {
+            struct dirent64 *e = (struct dirent64 *)(dents + off);
+            off += e->d_reclen;
+            if (e->d_name[0] == '.') {
+                continue;
             }
-            limpio = 1;
+            reservarEntrada(s, e->d_name, e->d_type != DT_UNKNOWN ? DTTOIF(e->d_type) : 0);
         }
     }
+    return bytes == 0;
 }
 
-// Configura los manejadores de señales SIGALRM y SIGUSR1
-void confSignals() {
-    struct sigaction sa;
-    sa.sa_handler = manejadorSignal;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
+// Función para actualizar el archivo de registro con los cambios en el directorio. Los nombres
+// se escriben detrás de ruta, la del directorio relativa a la raíz ("" para la raíz). Cada
+// entrada nueva se empareja con la vieja de su mismo (dev, ino) en la tabla hash, así que los
+// renombrados se detectan aunque cambie su posición en el directorio. Devuelve cuántos cambios
+// ha registrado
+int actualizarArchivo(const char *ruta, struct Instantanea *vieja, const struct Instantanea *nueva) {
+    int cambios = 0;
+    if (vieja->capacidadVistos < vieja->numEntradas) {
+        free(vieja->vistos);
+        vieja->capacidadVistos = vieja->numEntradas;
+        vieja->vistos = malloc(vieja->capacidadVistos);
+        if (vieja->vistos == NULL) {
+            perror("ERROR: malloc()");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (vieja->numEntradas > 0) {
+        memset(vieja->vistos, 0, vieja->numEntradas);
+    }
 
-    if (sigaction(SIGALRM, &sa, NULL) == -1) {
-        fprintf(stderr, "ERROR: sigaction()\n");
+    for (int i = 0; i < nueva->numEntradas; i++) {
+        const struct FileInfo *n = &nueva->entradas[i];
+        const char *nombre = nombreDe(nueva, n);
+        if (n->borrada || nombre[0] == '.') {
+            continue;
+        }
+        int j = buscarInodo(vieja, n->dev, n->ino, nombre, vieja->vistos);
+        if (j < 0) {
+            registrar(EVENTO_CREACION, ruta, nombre, NULL, 0, 0);
+            cambios++;
+            continue;
+        }
+        const struct FileInfo *o = &vieja->entradas[j];
+        vieja->vistos[j] = 1;
+        if (strcmp(nombreDe(vieja, o), nombre) != 0) {
+            registrar(EVENTO_NOMBRE, ruta, nombreDe(vieja, o), nombre, 0, 0);
+            cambios++;
+        } else if (contenido) {
+            // Solo cuenta el contenido: un touch o un chmod no se registran
+            if (S_ISREG(n->mode) && o->hash != n->hash) {
+                registrar(EVENTO_CONTENIDO, ruta, nombre, NULL, o->hash, n->hash);
+                cambios++;
+            }
+        } else if (o->size != n->size) {
+            registrar(EVENTO_TAMANO, ruta, nombre, NULL, o->size, n->size);
+            cambios++;
+        } else if (o->mtime != n->mtime) {
+            registrar(EVENTO_MTIME, ruta, nombre, NULL, o->mtime, n->mtime);
+            cambios++;
+        }
+    }
+
+    for (int i = 0; i < vieja->numEntradas; i++) {
+        const struct FileInfo *o = &vieja->entradas[i];
+        if (!vieja->vistos[i] && !o->borrada && nombreDe(vieja, o)[0] != '.') {
+            registrar(EVENTO_BORRADO, ruta, nombreDe(vieja, o), NULL, 0, 0);
+            cambios++;
+        }
+    }
+    return cambios;
+}
+
+// Función para intercambiar dos instantáneas, de modo que la vieja se reutiliza en la
+// siguiente lectura
+void intercambiarInstantaneas(struct Instantanea *a, struct Instantanea *b) {
+    struct Instantanea t = *a;
+    *a = *b;
+    *b = t;
+}
+
+// Función para releer el directorio entero, registrar las diferencias con la última
+// instantánea y sustituirla. Devuelve cuántos cambios ha registrado
+int refrescarDirectorio(void) {
+    vaciarInstantanea(&siguiente);
+    // El descriptor del directorio vigilado se reutiliza volviendo al principio de sus entradas
+    if (lseek(fdDirectorio, 0, SEEK_SET) == -1 || !leerEntradas(fdDirectorio, &siguiente)) {
+        fprintf(stderr, "ERROR: getdents64()\n");
         exit(EXIT_FAILURE);
     }
+    consultarEntradas(fdDirectorio, &siguiente, 0);
+    if (contenido) {
+        prepararHashes(fdDirectorio, &actual, &siguiente);
+    }
+
+    int cambios = actualizarArchivo("", &actual, &siguiente);
+    intercambiarInstantaneas(&actual, &siguiente);
+    return cambios;
+}
+
+// Función para comparar directorios por su ruta. Así el subárbol de cada directorio queda
+// justo detrás de él
+int compararDirectorio(const void *a, const void *b) {
+    return strcmp(((const struct Directorio *)a)->ruta, ((const struct Directorio *)b)->ruta);
+}
+
+// Función para buscar un directorio por su ruta. Devuelve su índice o -1
+int buscarDirectorio(const char *ruta) {
+    struct Directorio clave;
+    clave.ruta = (char *)ruta;
+    struct Directorio *d = bsearch(&clave, directorios, numDirectorios, sizeof(struct Directorio), compararDirectorio);
+    return d != NULL ? (int)(d - directorios) : -1;
+}
 
-    if (sigaction(SIGUSR1, &sa, NULL) == -1) {
-        fprintf(stderr, "ERROR: sigaction()\n");
+// Función para añadir un directorio pendiente de leer, en su sitio según la ruta
+void anadirDirectorio(const char *ruta, const struct FileInfo *info) {
+    struct Directorio *nuevos = realloc(directorios, (numDirectorios + 1) * sizeof(struct Directorio));
+    if (nuevos == NULL) {
+        perror("ERROR: realloc()");
+        exit(EXIT_FAILURE);
+    }
+    directorios = nuevos;
+    struct Directorio d;
+    memset(&d, 0, sizeof(d));
+    d.ruta = strdup(ruta);
+    if (d.ruta == NULL) {
+        perror("ERROR: strdup()");
         exit(EXIT_FAILURE);
     }
+    d.dev = info->dev;
+    d.ino = info->ino;
+    d.releer = 1;
+    int i = 0;
+    while (i < numDirectorios && strcmp(directorios[i].ruta, ruta) < 0) {
+        i++;
+    }
+    memmove(&directorios[i + 1], &directorios[i], (numDirectorios - i) * sizeof(struct Directorio));
+    directorios[i] = d;
+    numDirectorios++;
+}
+
+// Función para saber cuántos directorios ocupa el subárbol que empieza en i
+int tamanoSubarbol(int i) {
+    size_t len = strlen(directorios[i].ruta);
+    int j = i + 1;
+    while (j < numDirectorios && strncmp(directorios[j].ruta, directorios[i].ruta, len) == 0) {
+        j++;
+    }
+    return j - i;
+}
 
-    manejadorSignal(SIGALRM);
+// Función para quitar un directorio que ha desaparecido junto con todo su subárbol,
+// registrando el borrado de lo que contenían. Devuelve cuántos borrados ha registrado
+int quitarSubarbol(int i) {
+    int n = tamanoSubarbol(i);
+    int cambios = 0;
+    for (int j = i; j < i + n; j++) {
+        struct Instantanea *s = &directorios[j].actual;
+        for (int k = 0; k < s->numEntradas; k++) {
+            if (!s->entradas[k].borrada && nombreDe(s, &s->entradas[k])[0] != '.') {
+                registrar(EVENTO_BORRADO, directorios[j].ruta, nombreDe(s, &s->entradas[k]), NULL, 0, 0);
+                cambios++;
+            }
+        }
+        free(directorios[j].ruta);
+        liberarInstantanea(&directorios[j].actual);
+        liberarInstantanea(&directorios[j].siguiente);
+    }
+    memmove(&directorios[i], &directorios[i + n], (numDirectorios - i - n) * sizeof(struct Directorio));
+    numDirectorios -= n;
+    return cambios;
+}
+
+// Función para cambiar la ruta de un subárbol renombrado, sin volver a leerlo
+void renombrarSubarbol(int i, const char *nueva) {
+    int n = tamanoSubarbol(i);
+    size_t viejaLen = strlen(directorios[i].ruta);
+    size_t nuevaLen = strlen(nueva);
+    for (int j = i; j < i + n; j++) {
+        const char *resto = directorios[j].ruta + viejaLen;
+        char *ruta = malloc(nuevaLen + strlen(resto) + 1);
+        if (ruta == NULL) {
+            perror("ERROR: malloc()");
+            exit(EXIT_FAILURE);
+        }
+        strcpy(ruta, nueva);
+        strcpy(ruta + nuevaLen, resto);
+        free(directorios[j].ruta);
+        directorios[j].ruta = ruta;
+    }
+    qsort(directorios, numDirectorios, sizeof(struct Directorio), compararDirectorio);
+}
+
+// Función para formar la ruta "padre/nombre/" de un subdirectorio. Devuelve 0 si no cabe en
+// PATH_MAX, y entonces la ruta no vale como clave de directorios
+int rutaSubdirectorio(char ruta[PATH_MAX], const char *padre, const char *nombre) {
+    return snprintf(ruta, PATH_MAX, "%s%s/", padre, nombre) < PATH_MAX;
+}
+
+// Función para leer un directorio del árbol y registrar sus cambios. Si su mtime y su ctime no
+// han cambiado, la lista de entradas es la misma y solo se vuelven a consultar las conocidas.
+// Devuelve cuántos cambios ha registrado, o -1 si el directorio ya no existe
+int escanearDirectorioArbol(int i) {
+    struct Directorio *d = &directorios[i];
+    int dfd = openat(fdDirectorio, d->ruta[0] != '\0' ? d->ruta : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat dirStat;
+    if (dfd == -1 || fstat(dfd, &dirStat) != 0) {
+        if (dfd != -1) {
+            close(dfd);
+        }
+        return -1;
+    }
+
+    struct Instantanea *nuevas = &d->siguiente;
+    vaciarInstantanea(nuevas);
+    int mismaLista = !d->releer &&
+                     dirStat.st_mtim.tv_sec == d->mtime.tv_sec && dirStat.st_mtim.tv_nsec == d->mtime.tv_nsec &&
+                     dirStat.st_ctim.tv_sec == d->ctime.tv_sec && dirStat.st_ctim.tv_nsec == d->ctime.tv_nsec;
+    if (mismaLista) {
+        // Solo pueden haber cambiado los datos de las entradas
+        for (int k = 0; k < d->actual.numEntradas; k++) {
+            const struct FileInfo *e = &d->actual.entradas[k];
+            if (!e->borrada) {
+                reservarEntrada(nuevas, nombreDe(&d->actual, e), e->mode & S_IFMT);
+            }
+        }
+    } else if (!leerEntradas(dfd, nuevas)) {
+        close(dfd);
+        return -1;
+    }
+    // Sin seguir enlaces simbólicos para no entrar en bucles
+    consultarEntradas(dfd, nuevas, AT_SYMLINK_NOFOLLOW);
+    if (contenido) {
+        prepararHashes(dfd, &d->actual, nuevas);
+    }
+    close(dfd);
+
+    int cambios = actualizarArchivo(d->ruta, &d->actual, nuevas);
+
+    // Con marcas de tiempo de grano grueso, un cambio en el mismo segundo que esta lectura no
+    // movería el mtime: si es reciente, la próxima vez se relee igualmente
+    d->releer = dirStat.st_mtim.tv_sec >= time(NULL) - 1;
+    d->mtime = dirStat.st_mtim;
+    d->ctime = dirStat.st_ctim;
+    intercambiarInstantaneas(&d->actual, &d->siguiente);
+    if (!recursivo) {
+        return cambios;
+    }
+
+    // Subdirectorios que han desaparecido: se quitan salvo que sigan con otro nombre. Las
+    // bajas y los renombrados solo mueven directorios detrás de i, así que d sigue siendo válido
+    struct Instantanea *viejas = &d->siguiente;
+    nuevas = &d->actual;
+    char ruta[PATH_MAX];
+    char rutaPadre[PATH_MAX];
+    snprintf(rutaPadre, sizeof(rutaPadre), "%s", d->ruta);
+    for (int k = 0; k < viejas->numEntradas; k++) {
+        const struct FileInfo *v = &viejas->entradas[k];
+        const char *nombre = nombreDe(viejas, v);
+        if (v->borrada || !S_ISDIR(v->mode) || nombre[0] == '.') {
+            continue;
+        }
+        int n = buscarInodo(nuevas, v->dev, v->ino, nombre, NULL);
+        const char *nuevo = n >= 0 ? nombreDe(nuevas, &nuevas->entradas[n]) : NULL;
+        if (nuevo != NULL && S_ISDIR(nuevas->entradas[n].mode) && strcmp(nuevo, nombre) == 0) {
+            continue;
+        }
+        // Una ruta demasiado larga nunca se ha llegado a vigilar
+        int j = rutaSubdirectorio(ruta, rutaPadre, nombre) ? buscarDirectorio(ruta) : -1;
+        if (j < 0) {
+            continue;
+        }
+        char destino[PATH_MAX];
+        int renombrado = 0;
+        if (nuevo != NULL && S_ISDIR(nuevas->entradas[n].mode) && nuevo[0] != '.') {
+            if (rutaSubdirectorio(destino, rutaPadre, nuevo) && buscarDirectorio(destino) < 0) {
+                renombrarSubarbol(j, destino);
+                renombrado = 1;
+            }
+        }
+        if (!renombrado) {
+            cambios += quitarSubarbol(j);
+        }
+    }
+
+    // Subdirectorios nuevos: se leen más adelante en la misma pasada
+    for (int k = 0; k < directorios[i].actual.numEntradas; k++) {
+        nuevas = &directorios[i].actual; // Las altas mueven el vector
+        const struct FileInfo *e = &nuevas->entradas[k];
+        if (!e->borrada && S_ISDIR(e->mode) && nombreDe(nuevas, e)[0] != '.') {
+            if (!rutaSubdirectorio(ruta, rutaPadre, nombreDe(nuevas, e))) {
+                // Se avisa solo la primera vez que se ve, no en cada pasada
+                int v = buscarInodo(viejas, e->dev, e->ino, nombreDe(nuevas, e), NULL);
+                if (v < 0 || strcmp(nombreDe(viejas, &viejas->entradas[v]), nombreDe(nuevas, e)) != 0) {
+                    fprintf(stderr, "WARNING: Path too long, not watching '%s%s/'.\n", rutaPadre, nombreDe(nuevas, e));
+                }
+            } else if (buscarDirectorio(ruta) < 0) {
+                struct FileInfo info = *e;
+                anadirDirectorio(ruta, &info);
+            }
+        }
+    }
+    return cambios;
+}
+
+// Función para recorrer el árbol entero. Los subárboles van detrás de su directorio, así que
+// los que se descubren en esta pasada se leen en ella. Devuelve cuántos cambios ha registrado
+int refrescarArbol(void) {
+    int cambios = 0;
+    if (numDirectorios == 0) {
+        struct FileInfo raiz;
+        struct stat dirStat;
+        memset(&raiz, 0, sizeof(raiz));
+        if (fstat(fdDirectorio, &dirStat) == 0) {
+            raiz.dev = dirStat.st_dev;
+            raiz.ino = dirStat.st_ino;
+        }
+        anadirDirectorio("", &raiz);
+    }
+    for (int i = 0; i < numDirectorios; i++) {
+        int n = escanearDirectorioArbol(i);
+        if (n < 0) {
+            if (i == 0) {
+                fprintf(stderr, "ERROR: opendir()\n");
+                exit(EXIT_FAILURE);
+            }
+            // Se ha borrado después de leer su padre: lo quitará la próxima lectura del padre
+            continue;
+        }
+        cambios += n;
+    }
+    return cambios;
+}
+
+// Cabecera del fichero de instantánea (-s). Detrás van la tabla de directorios y, por cada uno,
+// su ruta, sus entradas, su arena de nombres y sus dos tablas hash, todo alineado a 8 bytes y
+// con el mismo formato que en memoria, así que se usa proyectado sin convertir nada
+struct CabeceraInstantanea {
+    char magia[8];             // MAGIA_INSTANTANEA
+    uint32_t version;          // VERSION_INSTANTANEA
+    uint32_t orden;            // 0x01020304 en el orden de bytes de quien la escribió
+    uint32_t recursivo;
+    uint32_t numDirectorios;
+    uint32_t contenido;        // Guardada con -c, así que lleva los hashes
+    uint32_t reservado;
+    uint64_t tamano;           // Del fichero entero
+};
+
+// Directorio del fichero de instantánea. Las secciones se dan como desplazamientos desde el
+// principio del fichero
+struct DirectorioInstantanea {
+    uint64_t ruta;
+    uint64_t entradas;
+    uint64_t nombres;
+    uint64_t porInodo;
+    uint64_t porNombre;
+    uint64_t usado;
+    uint64_t tamTabla;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime[2];          // Segundos y nanosegundos
+    int64_t ctime[2];
+    uint32_t numEntradas;
+    uint32_t releer;
+};
+
+// Proyección del fichero de instantánea cargado al arrancar, hasta que la primera lectura deja
+// de necesitarla
+void *proyeccion = NULL;
+size_t tamProyeccion = 0;
+
+// Función para redondear un tamaño al siguiente múltiplo de 8
+static inline size_t alinear8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+// Función para escribir un bloque y rellenarlo con ceros hasta un múltiplo de 8. Devuelve 0 si
+// falla la escritura
+static int escribirAlineado(FILE *f, const void *datos, size_t n) {
+    static const char ceros[8] = {0};
+    return (n == 0 || fwrite(datos, n, 1, f) == 1) &&
+           (alinear8(n) == n || fwrite(ceros, alinear8(n) - n, 1, f) == 1);
+}
+
+// Función para rellenar la descripción de un directorio de la instantánea, dejando sus
+// secciones a partir del desplazamiento off. Devuelve el desplazamiento siguiente
+static size_t describirDirectorio(int k, struct DirectorioInstantanea *t, size_t off) {
+    const struct Instantanea *s;
+    const char *ruta;
+    memset(t, 0, sizeof(*t));
+    if (recursivo) {
+        const struct Directorio *d = &directorios[k];
+        s = &d->actual;
+        ruta = d->ruta;
+        t->dev = d->dev;
+        t->ino = d->ino;
+        t->mtime[0] = d->mtime.tv_sec;
+        t->mtime[1] = d->mtime.tv_nsec;
+        t->ctime[0] = d->ctime.tv_sec;
+        t->ctime[1] = d->ctime.tv_nsec;
+        t->releer = d->releer;
+    } else {
+        struct stat dirStat;
+        s = &actual;
+        ruta = "";
+        if (fstat(fdDirectorio, &dirStat) == 0) {
+            t->dev = dirStat.st_dev;
+            t->ino = dirStat.st_ino;
+        }
+    }
+    t->numEntradas = s->numEntradas;
+    t->usado = s->usado;
+    t->tamTabla = s->tamTabla;
+    t->ruta = off;
+    off += alinear8(strlen(ruta) + 1);
+    t->entradas = off;
+    off += s->numEntradas * sizeof(struct FileInfo);
+    t->nombres = off;
+    off += alinear8(s->usado);
+    t->porInodo = off;
+    off += alinear8(s->tamTabla * sizeof(int32_t));
+    t->porNombre = off;
+    off += alinear8(s->tamTabla * sizeof(int32_t));
+    return off;
+}
+
+// Función para guardar la instantánea en el fichero de -s. Se escribe en un temporal que
+// después sustituye al fichero con rename(), así que quien lo lea nunca ve uno a medias
+void guardarInstantanea(void) {
+    int n = recursivo ? numDirectorios : 1;
+    struct DirectorioInstantanea *tabla = malloc(n * sizeof(struct DirectorioInstantanea));
+    char temporal[PATH_MAX];
+    if (tabla == NULL || snprintf(temporal, sizeof(temporal), "%s.tmp", ficheroInstantanea) >= (int)sizeof(temporal)) {
+        fprintf(stderr, "WARNING: Cannot save snapshot.\n");
+        free(tabla);
+        return;
+    }
+
+    struct CabeceraInstantanea cabecera;
+    memset(&cabecera, 0, sizeof(cabecera));
+    memcpy(cabecera.magia, MAGIA_INSTANTANEA, sizeof(cabecera.magia));
+    cabecera.version = VERSION_INSTANTANEA;
+    cabecera.orden = 0x01020304;
+    cabecera.recursivo = recursivo;
+    cabecera.contenido = contenido;
+    cabecera.numDirectorios = n;
+    size_t off = alinear8(sizeof(cabecera) + n * sizeof(struct DirectorioInstantanea));
+    for (int k = 0; k < n; k++) {
+        off = describirDirectorio(k, &tabla[k], off);
+    }
+    cabecera.tamano = off;
+
+    FILE *f = fopen(temporal, "wb");
+    int ok = f != NULL && fwrite(&cabecera, sizeof(cabecera), 1, f) == 1 &&
+             escribirAlineado(f, tabla, n * sizeof(struct DirectorioInstantanea));
+    for (int k = 0; k < n && ok; k++) {
+        const struct Instantanea *s = recursivo ? &directorios[k].actual : &actual;
+        const char *ruta = recursivo ? directorios[k].ruta : "";
+        ok = escribirAlineado(f, ruta, strlen(ruta) + 1) &&
+             escribirAlineado(f, s->entradas, s->numEntradas * sizeof(struct FileInfo)) &&
+             escribirAlineado(f, s->nombres, s->usado) &&
+             escribirAlineado(f, s->porInodo, s->tamTabla * sizeof(int32_t)) &&
+             escribirAlineado(f, s->porNombre, s->tamTabla * sizeof(int32_t));
+    }
+    if (f != NULL && fclose(f) != 0) {
+        ok = 0;
+    }
+    if (!ok || rename(temporal, ficheroInstantanea) != 0) {
+        fprintf(stderr, "WARNING: Cannot save snapshot to '%s'.\n", ficheroInstantanea);
+        unlink(temporal);
+    }
+    free(tabla);
+}
+
+// Función para saber si una sección de len bytes en off cabe alineada en el fichero
+static int cabe(uint64_t off, uint64_t len, uint64_t tamano) {
+    return off % 8 == 0 && off <= tamano && len <= tamano - off;
+}
+
+// Función para comprobar un directorio del fichero de instantánea antes de usarlo en su sitio:
+// secciones dentro del fichero, nombres terminados dentro de la arena y tablas con índices
+// válidos y al menos una casilla vacía. Devuelve 0 si está dañado
+static int validarDirectorio(const char *base, uint64_t tamano, const struct DirectorioInstantanea *t) {
+    if (!cabe(t->ruta, 1, tamano) || memchr(base + t->ruta, '\0', tamano - t->ruta) == NULL ||
+        !cabe(t->entradas, (uint64_t)t->numEntradas * sizeof(struct FileInfo), tamano) ||
+        !cabe(t->nombres, t->usado, tamano) || (t->usado > 0 && base[t->nombres + t->usado - 1] != '\0') ||
+        t->tamTabla > tamano || (t->tamTabla & (t->tamTabla - 1)) != 0 || (t->numEntradas > 0 && t->tamTabla == 0) ||
+        !cabe(t->porInodo, t->tamTabla * sizeof(int32_t), tamano) ||
+        !cabe(t->porNombre, t->tamTabla * sizeof(int32_t), tamano)) {
+        return 0;
+    }
+    const struct FileInfo *entradas = (const struct FileInfo *)(base + t->entradas);
+    for (uint32_t i = 0; i < t->numEntradas; i++) {
+        if (entradas[i].nombre >= t->usado) {
+            return 0;
+        }
+    }
+    const int32_t *tablas[2] = {(const int32_t *)(base + t->porInodo), (const int32_t *)(base + t->porNombre)};
+    for (int k = 0; k < 2; k++) {
+        int vacia = t->tamTabla == 0;
+        for (uint64_t h = 0; h < t->tamTabla; h++) {
+            if (tablas[k][h] < TABLA_BORRADA || tablas[k][h] >= (int64_t)t->numEntradas) {
+                return 0;
+            }
+            vacia |= tablas[k][h] == TABLA_VACIA;
+        }
+        if (!vacia) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Función para montar una instantánea prestada sobre un directorio del fichero proyectado
+static void prestarInstantanea(struct Instantanea *s, char *base, const struct DirectorioInstantanea *t) {
+    memset(s, 0, sizeof(*s));
+    s->entradas = (struct FileInfo *)(base + t->entradas);
+    s->numEntradas = t->numEntradas;
+    for (int i = 0; i < s->numEntradas; i++) {
+        s->vivas += !s->entradas[i].borrada;
+    }
+    s->nombres = base + t->nombres;
+    s->usado = t->usado;
+    s->porInodo = (int32_t *)(base + t->porInodo);
+    s->porNombre = (int32_t *)(base + t->porNombre);
+    s->tamTabla = t->tamTabla;
+    s->prestada = 1;
+}
+
+// Función para cargar la instantánea de la ejecución anterior proyectando el fichero de -s en
+// memoria de solo lectura. Las instantáneas quedan prestadas, apuntando a la proyección, y la
+// primera lectura registra contra ellas lo que cambió mientras watchdir no estaba. Si el fichero
+// no existe, está dañado o es de otro directorio o modo, se empieza de cero
+void cargarInstantanea(void) {
+    int fd = open(ficheroInstantanea, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "WARNING: Cannot open snapshot '%s', starting from scratch.\n", ficheroInstantanea);
+        }
+        return;
+    }
+    struct stat ficheroStat, dirStat;
+    if (fstat(fd, &ficheroStat) != 0 || fstat(fdDirectorio, &dirStat) != 0 ||
+        ficheroStat.st_size < (off_t)sizeof(struct CabeceraInstantanea)) {
+        close(fd);
+        fprintf(stderr, "WARNING: Ignoring invalid snapshot '%s'.\n", ficheroInstantanea);
+        return;
+    }
+    uint64_t tamano = ficheroStat.st_size;
+    char *base = mmap(NULL, tamano, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "WARNING: Cannot map snapshot '%s', starting from scratch.\n", ficheroInstantanea);
+        return;
+    }
+
+    const struct CabeceraInstantanea *cabecera = (const struct CabeceraInstantanea *)base;
+    const struct DirectorioInstantanea *tabla = (const struct DirectorioInstantanea *)(base + sizeof(*cabecera));
+    uint32_t n = cabecera->numDirectorios;
+    int valida = memcmp(cabecera->magia, MAGIA_INSTANTANEA, sizeof(cabecera->magia)) == 0 &&
+                 cabecera->version == VERSION_INSTANTANEA && cabecera->orden == 0x01020304 &&
+                 cabecera->recursivo == (uint32_t)recursivo && cabecera->contenido == (uint32_t)contenido &&
+                 cabecera->tamano == tamano &&
+                 n >= 1 && (recursivo || n == 1) &&
+                 cabe(0, sizeof(*cabecera) + (uint64_t)n * sizeof(struct DirectorioInstantanea), tamano) &&
+                 tabla[0].dev == (uint64_t)dirStat.st_dev && tabla[0].ino == (uint64_t)dirStat.st_ino;
+    for (uint32_t k = 0; k < n && valida; k++) {
+        valida = validarDirectorio(base, tamano, &tabla[k]) &&
+                 (k == 0 ? base[tabla[k].ruta] == '\0'
+                         : strcmp(base + tabla[k - 1].ruta, base + tabla[k].ruta) < 0); // Ordenados por ruta
+    }
+    if (!valida) {
+        munmap(base, tamano);
+        fprintf(stderr, "WARNING: Ignoring invalid snapshot '%s'.\n", ficheroInstantanea);
+        return;
+    }
+
+    proyeccion = base;
+    tamProyeccion = tamano;
+    if (!recursivo) {
+        prestarInstantanea(&actual, base, &tabla[0]);
+        return;
+    }
+    for (uint32_t k = 0; k < n; k++) {
+        struct FileInfo info;
+        memset(&info, 0, sizeof(info));
+        info.dev = tabla[k].dev;
+        info.ino = tabla[k].ino;
+        anadirDirectorio(base + tabla[k].ruta, &info); // Van en orden, así que queda el último
+        struct Directorio *d = &directorios[numDirectorios - 1];
+        d->mtime.tv_sec = tabla[k].mtime[0];
+        d->mtime.tv_nsec = tabla[k].mtime[1];
+        d->ctime.tv_sec = tabla[k].ctime[0];
+        d->ctime.tv_nsec = tabla[k].ctime[1];
+        d->releer = tabla[k].releer;
+        prestarInstantanea(&d->actual, base, &tabla[k]);
+    }
+}
+
+// Función para copiar al heap una instantánea que sigue prestada
+static void desprestarInstantanea(struct Instantanea *s) {
+    if (!s->prestada) {
+        return;
+    }
+    struct Instantanea copia;
+    memset(&copia, 0, sizeof(copia));
+    for (int i = 0; i < s->numEntradas; i++) {
+        if (!s->entradas[i].borrada) {
+            anadirEntrada(&copia, nombreDe(s, &s->entradas[i]), &s->entradas[i]);
+        }
+    }
+    liberarInstantanea(s);
+    *s = copia;
+}
+
+// Función para deshacer la proyección tras la primera lectura. Las instantáneas que aún la
+// usan se copian antes; normalmente solo quedan las viejas, que se descartan
+void soltarProyeccion(void) {
+    if (proyeccion == NULL) {
+        return;
+    }
+    if (recursivo) {
+        for (int i = 0; i < numDirectorios; i++) {
+            desprestarInstantanea(&directorios[i].actual);
+            vaciarInstantanea(&directorios[i].siguiente);
+        }
+    } else {
+        desprestarInstantanea(&actual);
+        vaciarInstantanea(&siguiente);
+    }
+    munmap(proyeccion, tamProyeccion);
+    proyeccion = NULL;
+}
+
+// Función para leer los datos de una entrada del directorio vigilado. Devuelve 0 si ya no existe
+int leerEntrada(const char *nombre, struct FileInfo *info) {
+    return consultarEntrada(fdDirectorio, nombre, 0, 1, info);
+}
+
+// Función para registrar una entrada nueva (IN_CREATE o IN_MOVED_TO sin pareja)
+void eventoCreacion(const char *nombre) {
+    struct FileInfo info;
+    if (!leerEntrada(nombre, &info)) {
+        return; // Ya se ha borrado; llegará su IN_DELETE
+    }
+    info.hash = contenido && S_ISREG(info.mode) ? hashFichero(fdDirectorio, nombre) : 0;
+    int i = buscarNombre(&actual, nombre);
+    if (i >= 0) {
+        if (actual.entradas[i].ino == info.ino && actual.entradas[i].dev == info.dev) {
+            return;
+        }
+        // Había otra con el mismo nombre de la que no se supo el borrado
+        registrar(EVENTO_BORRADO, "", nombre, NULL, 0, 0);
+        quitarEntrada(&actual, i);
+    }
+    anadirEntrada(&actual, nombre, &info);
+    registrar(EVENTO_CREACION, "", nombre, NULL, 0, 0);
+}
+
+// Ficheros con IN_MODIFY que con -c aún no se han releído. Se releen todos juntos cuando vence
+// el plazo del primero, para no calcular el hash en cada write() de quien va añadiendo a un
+// fichero que mantiene abierto
+struct Pendientes {
+    char nombres[MAX_PENDIENTES][NAME_MAX + 1];
+    int num;
+    struct timespec plazo;  // CLOCK_MONOTONIC
+};
+struct Pendientes pendientes;
+
+void eventoCambio(const char *nombre);
+
+// Función para releer los ficheros pendientes
+void vaciarPendientes(void) {
+    for (int i = 0; i < pendientes.num; i++) {
+        eventoCambio(pendientes.nombres[i]);
+    }
+    pendientes.num = 0;
+}
+
+// Función para dejar un fichero pendiente de releer, si no lo estaba ya
+void marcarPendiente(const char *nombre) {
+    for (int i = 0; i < pendientes.num; i++) {
+        if (strcmp(pendientes.nombres[i], nombre) == 0) {
+            return;
+        }
+    }
+    if (pendientes.num == MAX_PENDIENTES) {
+        vaciarPendientes();
+    }
+    if (pendientes.num == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &pendientes.plazo);
+        pendientes.plazo.tv_nsec += ESPERA_CONTENIDO_MS * 1000000L;
+        if (pendientes.plazo.tv_nsec >= 1000000000L) {
+            pendientes.plazo.tv_sec++;
+            pendientes.plazo.tv_nsec -= 1000000000L;
+        }
+    }
+    snprintf(pendientes.nombres[pendientes.num++], NAME_MAX + 1, "%s", nombre);
+}
+
+// Función para quitar un fichero de los pendientes. Devuelve 1 si lo estaba
+int quitarPendiente(const char *nombre) {
+    for (int i = 0; i < pendientes.num; i++) {
+        if (strcmp(pendientes.nombres[i], nombre) == 0) {
+            pendientes.num--;
+            if (i != pendientes.num) {
+                memcpy(pendientes.nombres[i], pendientes.nombres[pendientes.num], NAME_MAX + 1);
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Función para calcular los milisegundos que faltan para releer los pendientes (0 si ya toca)
+int esperaPendientes(void) {
+    struct timespec ahora;
+    clock_gettime(CLOCK_MONOTONIC, &ahora);
+    long long ms = (pendientes.plazo.tv_sec - ahora.tv_sec) * 1000LL +
+                   (pendientes.plazo.tv_nsec - ahora.tv_nsec) / 1000000L;
+    return ms > 0 ? (int)ms : 0;
+}
+
+// Función para registrar una entrada borrada (IN_DELETE o IN_MOVED_FROM sin pareja)
+void eventoBorrado(const char *nombre) {
+    quitarPendiente(nombre);
+    int i = buscarNombre(&actual, nombre);
+    if (i >= 0) {
+        quitarEntrada(&actual, i);
+        registrar(EVENTO_BORRADO, "", nombre, NULL, 0, 0);
+    }
+}
+
+// Función para registrar un renombrado (IN_MOVED_FROM e IN_MOVED_TO con la misma cookie)
+void eventoRenombrado(const char *viejo, const char *nuevo) {
+    // Si se escribió antes de renombrarlo, se relee con el nombre nuevo
+    int pendiente = quitarPendiente(viejo);
+    quitarPendiente(nuevo);
+    int i = buscarNombre(&actual, viejo);
+    if (i < 0) {
+        eventoCreacion(nuevo);
+        return;
+    }
+    struct FileInfo info = actual.entradas[i];
+    quitarEntrada(&actual, i);
+    int j = buscarNombre(&actual, nuevo);
+    if (j >= 0) {
+        // El renombrado ha sustituido a otra entrada
+        registrar(EVENTO_BORRADO, "", nuevo, NULL, 0, 0);
+        quitarEntrada(&actual, j);
+    }
+    anadirEntrada(&actual, nuevo, &info);
+    registrar(EVENTO_NOMBRE, "", viejo, nuevo, 0, 0);
+    if (pendiente) {
+        marcarPendiente(nuevo);
+    }
+}
+
+// Función para registrar cambios de tamaño o de fecha (IN_MODIFY o IN_ATTRIB), o de contenido
+// con -c (IN_MODIFY tras ESPERA_CONTENIDO_MS, IN_CLOSE_WRITE o IN_ATTRIB). El fichero solo se
+// lee si sus metadatos han cambiado
+void eventoCambio(const char *nombre) {
+    struct FileInfo info;
+    int i = buscarNombre(&actual, nombre);
+    if (i < 0 || !leerEntrada(nombre, &info)) {
+        return;
+    }
+    struct FileInfo *e = &actual.entradas[i];
+    if (contenido) {
+        if (mismosMetadatos(e, &info)) {
+            return;
+        }
+        info.hash = S_ISREG(info.mode) ? hashFichero(fdDirectorio, nombre) : 0;
+        if (S_ISREG(info.mode) && e->hash != info.hash) {
+            registrar(EVENTO_CONTENIDO, "", nombre, NULL, e->hash, info.hash);
+        }
+        e->hash = info.hash;
+    } else if (e->size != info.size) {
+        registrar(EVENTO_TAMANO, "", nombre, NULL, e->size, info.size);
+    } else if (e->mtime != info.mtime) {
+        registrar(EVENTO_MTIME, "", nombre, NULL, e->mtime, info.mtime);
+    }
+    // El inodo no cambia, así que la entrada sigue en su casilla de las tablas
+    e->mtime = info.mtime;
+    e->mtimeNsec = info.mtimeNsec;
+    e->ctime = info.ctime;
+    e->ctimeNsec = info.ctimeNsec;
+    e->size = info.size;
+    e->mode = info.mode;
+}
+
+// Función para vigilar el directorio con inotify. Devuelve el descriptor, o -1 si no se puede
+// y hay que volver a releerlo cada intervalo
+int iniciarInotify(void) {
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "WARNING: inotify not available, rescanning every %g seconds.\n", intervalo);
+        return -1;
+    }
+    // Con -c, IN_CLOSE_WRITE relee el fichero en cuanto se cierra sin esperar a los IN_MODIFY
+    uint32_t mascara = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_MODIFY |
+                       (contenido ? IN_CLOSE_WRITE : 0) | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+    if (inotify_add_watch(fd, dirNombre, mascara) == -1) {
+        fprintf(stderr, "WARNING: inotify_add_watch() failed, rescanning every %g seconds.\n", intervalo);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Función para procesar los eventos de inotify sin fin. Un IN_MOVED_FROM queda pendiente hasta
+// ver si el siguiente evento es su IN_MOVED_TO; si el buffer se queda sin eventos se espera un
+// poco a que llegue antes de darlo por borrado. Si la cola del núcleo se desborda se relee el
+// directorio entero para no perder cambios. Con -c, los IN_MODIFY se juntan en los pendientes,
+// que se releen al vencer su plazo aunque sigan llegando eventos. Con -s, la instantánea se
+// guarda cuando los eventos dejan de llegar durante ESPERA_GUARDADO_MS, o antes de volver si el
+// bucle principal avisa de que hay que terminar
+void bucleInotify(int fd) {
+    char buffer[TAM_EVENTOS] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char movido[NAME_MAX + 1];  // Nombre del IN_MOVED_FROM pendiente
+    uint32_t cookie = 0;
+    int hayMovido = 0;
+    int sinGuardar = 0;
+
+    while (1) {
+        if (pendientes.num > 0 && !hayMovido && esperaPendientes() == 0) {
+            vaciarPendientes();
+        }
+        struct pollfd pfd[2] = {{fd, POLLIN, 0}, {fdAviso, POLLIN, 0}};
+        int listo = poll(pfd, 2, hayMovido ? ESPERA_RENOMBRADO_MS :
+                                 pendientes.num > 0 ? esperaPendientes() :
+                                 sinGuardar ? ESPERA_GUARDADO_MS : -1);
+        if (listo == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "ERROR: poll()\n");
+            exit(EXIT_FAILURE);
+        }
+        if (pfd[1].revents & POLLIN) {
+            // Lo que quede pendiente lo encontrará la siguiente ejecución al comparar con la
+            // instantánea, que así coincide con lo registrado
+            if (sinGuardar) {
+                guardarInstantanea();
+            }
+            return;
+        }
+        if (listo == 0 && hayMovido) {
+            eventoBorrado(movido);
+            hayMovido = 0;
+            continue;
+        }
+        if (listo == 0 && pendientes.num > 0) {
+            continue; // Se releen al principio de la vuelta
+        }
+        if (listo == 0) {
+            guardarInstantanea();
+            sinGuardar = 0;
+            continue;
+        }
+
+        ssize_t leido = read(fd, buffer, sizeof(buffer));
+        if (leido == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "ERROR: read()\n");
+            exit(EXIT_FAILURE);
+        }
+
+        const struct inotify_event *ev;
+        for (char *p = buffer; p < buffer + leido; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (const struct inotify_event *)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                hayMovido = 0;
+                pendientes.num = 0;
+                refrescarDirectorio();
+                continue;
+            }
+            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                fprintf(stderr, "ERROR: '%s' was removed or moved.\n", dirNombre);
+                exit(EXIT_FAILURE);
+            }
+            if (ev->len == 0 || ev->name[0] == '.') {
+                continue;
+            }
+            if (hayMovido && !((ev->mask & IN_MOVED_TO) && ev->cookie == cookie)) {
+                // Se movió fuera del directorio
+                eventoBorrado(movido);
+                hayMovido = 0;
+            }
+
+            if (ev->mask & IN_MOVED_FROM) {
+                strncpy(movido, ev->name, sizeof(movido) - 1);
+                movido[sizeof(movido) - 1] = '\0';
+                cookie = ev->cookie;
+                hayMovido = 1;
+            } else if (ev->mask & IN_MOVED_TO) {
+                if (hayMovido) {
+                    eventoRenombrado(movido, ev->name);
+                    hayMovido = 0;
+                } else {
+                    eventoCreacion(ev->name); // Viene de fuera del directorio
+                }
+            } else if (ev->mask & IN_CREATE) {
+                eventoCreacion(ev->name);
+            } else if (ev->mask & IN_DELETE) {
+                eventoBorrado(ev->name);
+            } else if ((ev->mask & IN_MODIFY) && contenido) {
+                marcarPendiente(ev->name);
+            } else if (ev->mask & (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE)) {
+                quitarPendiente(ev->name);
+                eventoCambio(ev->name);
+            }
+        }
+        sinGuardar = ficheroInstantanea != NULL;
+    }
+}
+
+// Bloquea SIGUSR1, SIGTERM y SIGINT, antes de crear los hilos para que lo hereden, y devuelve
+// un signalfd para atenderlas en el bucle principal
+int confSignals(void) {
+    sigset_t senales;
+    sigemptyset(&senales);
+    sigaddset(&senales, SIGUSR1);
+    sigaddset(&senales, SIGTERM);
+    sigaddset(&senales, SIGINT);
+    if (pthread_sigmask(SIG_BLOCK, &senales, NULL) != 0) {
+        fprintf(stderr, "ERROR: pthread_sigmask()\n");
+        exit(EXIT_FAILURE);
+    }
+    int fd = signalfd(-1, &senales, SFD_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "ERROR: signalfd()\n");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
 }
 
 // Verifica si la ruta es un directorio
@@ -215,14 +1988,85 @@ void test_numdir(int argc, char *argv[]) {
 // Función para procesar las opciones de línea de comandos
 void procesarArgumentos(int argc, char *argv[]) {
     int opt = 0;
-    while ((opt = getopt(argc, argv, "hn:l:")) != -1) {
+    while ((opt = getopt(argc, argv, "hpRcj:n:l:F:m:a:y:s:")) != -1) {
         switch (opt) {
-            case 'n':
-                intervalo = atoi(optarg);
+            case 'R':
+                // El árbol se vigila releyendo los directorios cada intervalo
+                recursivo = 1;
+                usarInotify = 0;
+                break;
+            case 'p':
+                usarInotify = 0;
+                break;
+            case 'c':
+                contenido = 1;
                 break;
+            case 'j':
+                hilosStat = atoi(optarg);
+                if (hilosStat < 0 || hilosStat > MAX_HILOS_STAT) {
+                    fprintf(stderr, "ERROR: THREADS must be a value in [0..64].\n");
+                    printUso(EXIT_FAILURE);
+                }
+                break;
+            case 'n': {
+                char *fin;
+                intervalo = strtod(optarg, &fin);
+                if (fin == optarg || *fin != '\0') {
+                    intervalo = 0; // No es un número: lo rechaza testIntervalo()
+                }
+                break;
+            }
             case 'l':
                 NombreRegistro = optarg;
                 break;
+            case 's':
+                ficheroInstantanea = optarg;
+                break;
+            case 'F':
+                if (strcmp(optarg, "json") == 0) {
+                    formatoJson = 1;
+                } else if (strcmp(optarg, "text") != 0) {
+                    fprintf(stderr, "ERROR: FORMAT must be 'text' or 'json'.\n");
+                    printUso(EXIT_FAILURE);
+                }
+                break;
+            case 'm': {
+                char *fin;
+                long long bytes = strtoll(optarg, &fin, 10);
+                const char *sufijos = "KMG";
+                const char *suf = *fin != '\0' ? strchr(sufijos, *fin) : NULL;
+                if (suf != NULL && fin[1] == '\0') {
+                    bytes <<= 10 * (suf - sufijos + 1);
+                } else if (*fin != '\0') {
+                    bytes = 0;
+                }
+                if (fin == optarg || bytes <= 0) {
+                    fprintf(stderr, "ERROR: BYTES must be a positive size.\n");
+                    printUso(EXIT_FAILURE);
+                }
+                rotarBytes = bytes;
+                break;
+            }
+            case 'a':
+                rotarSegundos = atoi(optarg);
+                if (rotarSegundos <= 0) {
+                    fprintf(stderr, "ERROR: the rotation age must be a positive number of seconds.\n");
+                    printUso(EXIT_FAILURE);
+                }
+                break;
+            case 'y':
+                if (strcmp(optarg, "none") == 0) {
+                    politicaFsync = -1;
+                } else if (strcmp(optarg, "always") == 0) {
+                    politicaFsync = 0;
+                } else {
+                    politicaFsync = atoi(optarg);
+                    if (politicaFsync <= 0) {
+                        fprintf(stderr, "ERROR: SYNC must be 'none', 'always' or a number of seconds.\n");
+                        printUso(EXIT_FAILURE);
+                    }
+                }
+                break;
             case 'h':
                 printUso(EXIT_SUCCESS);
                 break;
@@ -234,9 +2078,9 @@ void procesarArgumentos(int argc, char *argv[]) {
 }
 
 // Verifica el intervalo establecido
-void testIntervalo(int intervalo) {
-    if (intervalo < 1 || intervalo > 60) {
-        fprintf(stderr, "ERROR: SECONDS must be a value in [1..60].\n");
+void testIntervalo(double intervalo) {
+    if (!(intervalo >= MIN_INTERVAL && intervalo <= MAX_INTERVAL)) {
+        fprintf(stderr, "ERROR: SECONDS must be a value in [0.01..60].\n");
         printUso(EXIT_FAILURE);
     }
 }
@@ -251,30 +2095,184 @@ int abrirCrearArchivoRegistro(const char *NombreRegistro) {
     return descriptor;
 }
 
-// Función para configurar el temporizador para la señal SIGALRM
-void configurarTemporizador(int intervalo) {
-    struct itimerval timer;
-    timer.it_value.tv_sec = intervalo;
-    timer.it_value.tv_usec = 0;
+// Función para que el temporizador venza cada tantos segundos a partir de ahora
+void programarTemporizador(double segundos) {
+    struct itimerspec timer;
+    timer.it_value.tv_sec = (time_t)segundos;
+    timer.it_value.tv_nsec = (long)((segundos - (double)timer.it_value.tv_sec) * 1e9);
     timer.it_interval = timer.it_value;
 
-    if (setitimer(ITIMER_REAL, &timer, NULL) == -1) {
-        fprintf(stderr, "ERROR: setitimer()\n");
+    if (timerfd_settime(fdTemporizador, 0, &timer, NULL) == -1) {
+        fprintf(stderr, "ERROR: timerfd_settime()\n");
         exit(EXIT_FAILURE);
     }
 }
 
+// Función para crear el temporizador de las relecturas
+void configurarTemporizador(double intervalo) {
+    fdTemporizador = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (fdTemporizador == -1) {
+        fprintf(stderr, "ERROR: timerfd_create()\n");
+        exit(EXIT_FAILURE);
+    }
+    programarTemporizador(intervalo);
+}
+
+// Función para leer lo vigilado una vez y, con -s, guardar la instantánea si ha cambiado algo o
+// es la primera lectura. Devuelve cuántos cambios ha registrado
+int refrescar(void) {
+    static int primera = 1;
+    int cambios = recursivo ? refrescarArbol() : refrescarDirectorio();
+    if (ficheroInstantanea != NULL) {
+        soltarProyeccion();
+        if (cambios > 0 || primera) {
+            guardarInstantanea();
+        }
+    }
+    primera = 0;
+    return cambios;
+}
+
+// Función del hilo lector, el único que toca las instantáneas y escribe cambios en el
+// registro. Con inotify procesa sus eventos hasta que el bucle principal avisa de que hay que
+// terminar; si no, relee cada vez que el bucle principal le avisa, y los avisos que llegan
+// durante una lectura lenta se juntan en una sola. Si una lectura no encuentra cambios la
+// espera se dobla, hasta FACTOR_ESPERA_MAX veces el intervalo, y el primer cambio la devuelve
+// al intervalo
+void *hiloLector(void *arg) {
+    int fdInotify = (int)(intptr_t)arg;
+    refrescar();
+    if (fdInotify != -1) {
+        bucleInotify(fdInotify);
+        return NULL;
+    }
+
+    double espera = intervalo;
+    double esperaMax = intervalo * FACTOR_ESPERA_MAX;
+    if (esperaMax > MAX_INTERVAL) {
+        esperaMax = MAX_INTERVAL;
+    }
+    while (1) {
+        uint64_t avisos;
+        if (read(fdAviso, &avisos, sizeof(avisos)) != sizeof(avisos)) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "ERROR: read()\n");
+            exit(EXIT_FAILURE);
+        }
+        if (__atomic_load_n(&terminando, __ATOMIC_ACQUIRE)) {
+            return NULL; // refrescar() ya ha guardado la instantánea de lo registrado
+        }
+        double nueva = refrescar() > 0 ? intervalo : 2 * espera;
+        if (nueva > esperaMax) {
+            nueva = esperaMax;
+        }
+        if (nueva != espera) {
+            espera = nueva;
+            programarTemporizador(espera);
+        }
+    }
+    return NULL;
+}
+
+// Función para avisar al hilo lector de que hay que terminar y esperarlo, para que la
+// instantánea de -s se guarde con todo lo registrado antes de salir
+void terminarLector(pthread_t lector) {
+    __atomic_store_n(&terminando, 1, __ATOMIC_RELEASE);
+    uint64_t uno = 1;
+    if (write(fdAviso, &uno, sizeof(uno)) != sizeof(uno)) {
+        fprintf(stderr, "ERROR: write()\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_join(lector, NULL);
+}
+
+// Función para atender sin fin el temporizador y las señales. El trabajo de cada vencimiento se
+// pasa al hilo lector, así que vaciar el registro nunca espera a una lectura; terminar solo
+// espera a que acabe la que esté en curso
+void bucleEventos(int fdSenales, pthread_t lector) {
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    if (ep == -1) {
+        fprintf(stderr, "ERROR: epoll_create1()\n");
+        exit(EXIT_FAILURE);
+    }
+    int fds[2] = {fdSenales, fdTemporizador};
+    for (int i = 0; i < 2; i++) {
+        if (fds[i] == -1) {
+            continue;
+        }
+        struct epoll_event ev = {.events = EPOLLIN, .data.fd = fds[i]};
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, fds[i], &ev) == -1) {
+            fprintf(stderr, "ERROR: epoll_ctl()\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    while (1) {
+        struct epoll_event eventos[2];
+        int n = epoll_wait(ep, eventos, 2, -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "ERROR: epoll_wait()\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < n; i++) {
+            if (eventos[i].data.fd == fdTemporizador) {
+                uint64_t vencimientos;
+                if (read(fdTemporizador, &vencimientos, sizeof(vencimientos)) == sizeof(vencimientos)) {
+                    uint64_t uno = 1;
+                    if (write(fdAviso, &uno, sizeof(uno)) != sizeof(uno)) {
+                        fprintf(stderr, "ERROR: write()\n");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+            } else {
+                struct signalfd_siginfo info;
+                if (read(fdSenales, &info, sizeof(info)) != sizeof(info)) {
+                    continue;
+                }
+                if (info.ssi_signo == SIGUSR1) {
+                    pedirLimpieza();
+                } else {
+                    terminarLector(lector);
+                    exit(EXIT_SUCCESS); // cerrarRegistro() escribe lo pendiente
+                }
+            }
+        }
+    }
+}
+
 // Función principal del programa
 int main(int argc, char *argv[]) {
     procesarArgumentos(argc, argv);
     testIntervalo(intervalo);
-    int fdfolder = test_isFolder(dirNombre);
+    fdDirectorio = test_isFolder(dirNombre);
     descriptor = abrirCrearArchivoRegistro(NombreRegistro);
-    confSignals();
-    configurarTemporizador(intervalo);
-    while (1) {
-        pause();
+    if (ficheroInstantanea != NULL) {
+        cargarInstantanea();
+    }
+    int fdSenales = confSignals();
+    iniciarRegistro();
+    // La vigilancia empieza antes de la primera lectura para no perder cambios entre medias
+    int fdInotify = usarInotify ? iniciarInotify() : -1;
+    fdAviso = eventfd(0, EFD_CLOEXEC);
+    if (fdAviso == -1) {
+        fprintf(stderr, "ERROR: eventfd()\n");
+        exit(EXIT_FAILURE);
+    }
+    if (fdInotify == -1) {
+        configurarTemporizador(intervalo);
+    }
+    iniciarHilosStat();
+    pthread_t lector;
+    if (pthread_create(&lector, NULL, hiloLector, (void *)(intptr_t)fdInotify) != 0) {
+        fprintf(stderr, "ERROR: pthread_create()\n");
+        exit(EXIT_FAILURE);
     }
+    bucleEventos(fdSenales, lector);
     close(descriptor);
     return 0;
 }